@@ -126,6 +126,9 @@ const char resp_Join[] PROGMEM = "Join=";
 const char resp_Rate[] PROGMEM = "Rate=";
 const char resp_Power[] PROGMEM = "TxPower=";
 const char resp_Replace[] PROGMEM = "Replace=";
+const char resp_Auth[] PROGMEM = "Auth=";
+const char req_GetSys[] PROGMEM = "get sys\r";
+const char resp_WakeTmr[] PROGMEM = "WakeTmr=";
 
 /* Request and response for specific info */
 static const struct {
@@ -160,8 +163,14 @@ static const struct {
     { req_GetWLAN,   resp_Rate },         /* 25 */
     { req_GetWLAN,   resp_Power },        /* 26 */
     { req_GetOpt,    resp_Replace },      /* 27 */
+    { req_GetWLAN,   resp_Auth },         /* 28 */
+    { req_GetWLAN,   resp_Chan },         /* 29 */
+    { req_GetSys,    resp_WakeTmr },      /* 30 */
 };
 
+/* WIFLY_CONFIG_ITEMS must match the requests table */
+typedef char requestsSizeCheck[(sizeof(requests)/sizeof(requests[0]) == WIFLY_CONFIG_ITEMS) ? 1 : -1];
+
 /* Request indices, must match table above */
 typedef enum {
     WIFLY_GET_IP           = 0,
@@ -192,6 +201,9 @@ typedef enum {
     WIFLY_GET_RATE         = 25,
     WIFLY_GET_POWER        = 26,
     WIFLY_GET_REPLACE      = 27,
+    WIFLY_GET_AUTH         = 28,
+    WIFLY_GET_CHANNEL      = 29,
+    WIFLY_GET_WAKE         = 30,
 } e_wifly_requests;
 
 /**
@@ -220,7 +232,7 @@ static int simple_utoa(uint32_t val, uint8_t base, char *buf, int size)
     } else {
         do {
             nval = val & 0x0F;
-            tmpbuf[ind++] = nval + ((nval < 10) ? '0' : 'A');
+            tmpbuf[ind++] = nval + ((nval < 10) ? '0' : 'A' - 10);
             val >>= 4;
         } while (val);
         tmpbuf[ind++] = 'x';
@@ -310,25 +322,103 @@ IPAddress WiFly::atoip(char *buf)
 {
     IPAddress ip;
 
-    for (uint8_t ind=0; ind<3; ind++) {
+    for (uint8_t ind=0; ind<4; ind++) {
         ip[ind] = atou(buf);
         while (*buf >= '0'  && *buf <= '9') {
             buf++;
         }
         if (*buf == '\0') break;
+        buf++;
     }
 
     return ip;
 }
 
+/* Settings made by begin(), see init() */
+static const char setupCommands[][20] PROGMEM = {
+    "set u m 1",
+    "set sys printlvl 0",
+    "set comm remote 0"
+};
+
+/**
+ * FNV-1a hash of the setup commands and the WiFly's MAC address. Changes
+ * when begin()'s setup does, or when a different WiFly is fitted.
+ */
+static uint32_t setupFingerprint(const char *mac)
+{
+    uint32_t hash = 2166136261UL;
+    char ch;
+
+    for (uint8_t ind=0; ind < (sizeof(setupCommands)/sizeof(setupCommands[0])); ind++) {
+        for (const char *str = setupCommands[ind]; (ch = pgm_read_byte(str)) != 0; str++) {
+            hash ^= (uint8_t)ch;
+            hash *= 16777619UL;
+        }
+    }
+    while (*mac) {
+        hash ^= (uint8_t)*mac++;
+        hash *= 16777619UL;
+    }
+    return hash ? hash : 1;
+}
+
+/* Default time source, shared by all WiFly instances */
+static WFClock defaultClock;
+
 WiFly::WiFly()
 {
+    clock = &defaultClock;
+    batching = false;
+    batchFailed = false;
+    batchSent = 0;
+    batchPending = 0;
+    batchResults = 0;
+    cmdHead = NULL;
+    cmdTail = NULL;
+    cmdState = 0;
+    config = NULL;
+    configTTL = 0;
+    fingerprintStore = NULL;
+    optQueued = 0;
+    conQueued = false;
+    udpDest = NULL;
+    dnsTTL = WIFLY_DNS_TTL;
+    dnsHits = 0;
+    dnsMisses = 0;
+    flushDnsCache();
     inCommandMode = false;
+    modeKnown = false;
+    lastTx = 0;
+    guardTime = WIFLY_GUARD_TIME;
+    flushTime = 0;
+    prompt[0] = '\0';
+    gotPrompt = false;
+    sleeping = false;
+    readyLen = 0;
+    sleepStart = 0;
+    statusValid = false;
+    statusTime = 0;
+    statusTTL = WIFLY_STATUS_TTL;
+    wakeTime = 0;
+    bootTime = 0;
+    txCount = 0;
+    txThreshold = WIFLY_TX_BUFFER_SIZE < 64 ? WIFLY_TX_BUFFER_SIZE : 64;
+    txBuffering = false;
     exitCommand = 0;
     connected = false;
     connecting = false;
+    closed = false;
+    rxHead = 0;
+    rxTail = 0;
+    rxCount = 0;
+    markerLen = 0;
+    markerMask = 0;
+    markerTime = 0;
     dhcp = true;
+    passHash = 0;
     restoreHost = true;
+    udpAutoPair = false;
 #ifdef DEBUG
     debugOn = true;
 #else
@@ -338,7 +428,17 @@ WiFly::WiFly()
     dbgBuf = NULL;
     dbgInd = 0;
     dbgMax = 0;
+    dbgRead = 0;
+
+}
 
+/**
+ * Set the time source used for timeouts and delays.
+ * @param clk the clock to use, or NULL to use millis() and delay().
+ */
+void WiFly::setClock(WFClock *clk)
+{
+    clock = (clk != NULL) ? clk : &defaultClock;
 }
 
 /**
@@ -348,18 +448,64 @@ WiFly::WiFly()
 void WiFly::init()
 {
     int8_t dhcpMode=0;
+    uint32_t fingerprint = 0;
+    boolean setup = true;
+    uint32_t results = 0;
+    uint8_t inFlight;
+    char mac[20];
 
     lastPort = 0;
     lastHost[0] = 0;
 
-    if (!setopt(F("set u m 1"), (char *)NULL)) {
-        debug.println(F("Failed to turn off echo"));
+    /* Do all of the setup in one command mode session */
+    if (!startCommand()) {
+        debug.println(F("init: failed to start command"));
+        return;
+    }
+
+    /* The settings are already in place if an earlier begin() saved them in this WiFly */
+    if (fingerprintStore) {
+        fingerprint = setupFingerprint(getMAC(mac, sizeof(mac)) ? mac : "");
+        setup = (fingerprintStore(false, 0) != fingerprint);
     }
-    if (!setopt(F("set sys printlvl 0"), (char *)NULL)) {
-        debug.println(F("Failed to turn off sys print"));
+    if (setup) {
+        beginBatch();
+        for (uint8_t ind=0; ind < (sizeof(setupCommands)/sizeof(setupCommands[0])); ind++) {
+            setopt((const __FlashStringHelper *)setupCommands[ind], (char *)NULL);
+        }
+    }
+
+    /*
+     * Send the status requests straight after, their replies follow the
+     * batch's. Those that would put more than WIFLY_BATCH_DEPTH commands
+     * in flight are sent when they are read instead.
+     */
+    inFlight = batchPending;
+    if (inFlight < WIFLY_BATCH_DEPTH) {
+        send_P(F("show c\r"));
+        conQueued = true;
+        inFlight++;
     }
-    if (!setopt(F("set comm remote 0"), (char *)NULL)) {
-        debug.println(F("Failed to set comm remote"));
+    if (inFlight < WIFLY_BATCH_DEPTH) {
+        queueGetopt(WIFLY_GET_DHCP);
+        inFlight++;
+    }
+    if (inFlight < WIFLY_BATCH_DEPTH) {
+        queueGetopt(WIFLY_GET_REPLACE);
+    }
+
+    if (setup) {
+        endBatch(&results);
+
+        if (!(results & 0x01)) {
+            debug.println(F("Failed to turn off echo"));
+        }
+        if (!(results & 0x02)) {
+            debug.println(F("Failed to turn off sys print"));
+        }
+        if (!(results & 0x04)) {
+            debug.println(F("Failed to set comm remote"));
+        }
     }
 
     /* update connection status */
@@ -376,6 +522,13 @@ void WiFly::init()
     dhcp = !((dhcpMode == WIFLY_DHCP_MODE_OFF) || (dhcpMode == WIFLY_DHCP_MODE_SERVER));
 
     replaceChar = getSpaceReplace();
+
+    /* Save the settings so the next begin() can skip them */
+    if (setup && fingerprintStore && (results == 0x07) && save()) {
+        fingerprintStore(true, fingerprint);
+    }
+
+    finishCommand();
 }
 
 /**
@@ -391,6 +544,14 @@ boolean WiFly::begin(Stream *serialdev, Stream *debugPrint)
     debug.begin(debugPrint);
     serial = serialdev;
 
+    /* The WiFly may have been left in command mode, or asleep */
+    inCommandMode = false;
+    modeKnown = false;
+    optQueued = 0;
+    conQueued = false;
+    sleeping = false;
+    readyLen = 0;
+
     if (!enterCommandMode()) {
         debug.println(F("Failed to enter command mode"));
         return false;
@@ -414,10 +575,10 @@ int WiFly::getFreeMemory()
 {
     int free;
 
-    if ((int)__brkval == 0) {
-        free = ((int)&free) - ((int)&__bss_end);
+    if (__brkval == 0) {
+        free = (int)((uintptr_t)&free - (uintptr_t)&__bss_end);
     } else {
-        free = ((int)&free) - ((int)__brkval);
+        free = (int)((uintptr_t)&free - (uintptr_t)__brkval);
     }
     return free;
 }
@@ -434,8 +595,20 @@ void WiFly::flushRx(int timeout)
     DPRINT(F("flushed\r\n"));
 }
 
+/** Pass any staged transmit data to the serial interface */
+void WiFly::txFlush()
+{
+    if (txCount > 0) {
+        serial->write(txBuf, txCount);
+        txCount = 0;
+        lastTx = clock->millis();
+    }
+}
+
 /**
  * Write a byte to the WiFly.
+ * In command mode, or with write buffering enabled, the byte is staged
+ * and sent with the bytes around it.
  * @param byte - the byte to write.
  * @return the number of bytes written (1).
  */
@@ -444,150 +617,303 @@ size_t WiFly::write(uint8_t byte)
     if (dbgInd < dbgMax) {
         dbgBuf[dbgInd++] = byte;
     }
-    return serial->write(byte);
-}
 
-/* Read-ahead for checking for TCP stream close 
- * A circular buffer is used to keep read-ahead bytes and
- * feed them back to the user.
- */
-static char peekBuf[8];
-static uint8_t peekHead = 0;    /* head of buffer; new characters stored here */
-static uint8_t peekTail = 0;    /* Tail of buffer; characters read from here */
-static uint8_t peekCount = 0;    /* Number of characters in peek buffer */
+    if (!txBuffering && !inCommandMode) {
+        txFlush();
+        lastTx = clock->millis();
+        return serial->write(byte);
+    }
+
+    txBuf[txCount++] = byte;
+    if (txCount >= txThreshold) {
+        txFlush();
+    }
+    return 1;
+}
 
 /**
- * Return the next byte that a read() would return, but leave the
- * byte in the receive buffer.
- * @returns the next byte that would be read 
- * @retval -1 - no data in receive buffer
+ * Write a block of bytes to the WiFly.
+ * The bytes are passed to the serial interface in blocks of up to
+ * the staging threshold, which is limited to the WiFly's comm size
+ * (see setFlushSize()). Unless write buffering is enabled or the
+ * WiFly is in command mode, nothing is left staged on return.
+ * @param buf - the bytes to write
+ * @param size - the number of bytes to write
+ * @return the number of bytes written
  */
-int WiFly::peek()
+size_t WiFly::write(const uint8_t *buf, size_t size)
 {
-    if (peekCount == 0) {
-       return serial->peek();
-    } else {
-       return peekBuf[peekTail];
+    boolean hold = txBuffering || inCommandMode;
+    size_t count = size;
+    size_t len;
+
+    if (dbgInd < dbgMax) {
+        len = dbgMax - dbgInd;
+        if (len > size) {
+            len = size;
+        }
+        memcpy(&dbgBuf[dbgInd], buf, len);
+        dbgInd += len;
+    }
+
+    while (size > 0) {
+        if ((txCount == 0) && (size >= txThreshold)) {
+            /* Nothing to join up with, send whole blocks directly */
+            len = hold ? size - (size % txThreshold) : size;
+            serial->write(buf, len);
+            lastTx = clock->millis();
+        } else {
+            len = txThreshold - txCount;
+            if (len > size) {
+                len = size;
+            }
+            memcpy(&txBuf[txCount], buf, len);
+            txCount += len;
+            if (txCount >= txThreshold) {
+                txFlush();
+            }
+        }
+        buf += len;
+        size -= len;
+    }
+
+    if (!hold) {
+        txFlush();
     }
+
+    return count;
 }
 
-/** Check for a state change on the stream
- * @param str progmem string to check stream input for
- * @param peeked true if the caller peeked the first char of the string,
- *               false if the caller read the character already
- * @retval true - the state change was matched
- * @retval false - state change not matched
- * @note A side effect of this function is that it will store
- *       the unmatched string in the read-ahead peek buffer since
- *       it has to read the characters from the WiFly to check for 
- *       the match.  The peek buffer is used to feed those characters
- *       to the user ahead of reading any more characters from the WiFly.
+/**
+ * Write several pieces of data, in RAM or PROGMEM, as one contiguous
+ * burst. Everything goes through the staging buffer with no gaps
+ * between the pieces, so the WiFly's flush timer can't split them into
+ * separate packets, and no copy into a scratch buffer is needed.
+ * @param segs the pieces to write, in order
+ * @param count the number of pieces
+ * @returns the number of bytes written
  */
-boolean WiFly::checkStream(const __FlashStringHelper *fstr, boolean peeked)
+size_t WiFly::writev(const WFSegment *segs, uint8_t count)
 {
-    char next;
-    const char *str = (const char *)fstr;
+    boolean buffering = txBuffering;
+    size_t total = 0;
 
-#ifdef DEBUG
-    debug.print(F("checkStream: "));
-    debug.println((const __FlashStringHelper *)fstr);
-#endif
+    txBuffering = true;
+    for (uint8_t ind=0; ind < count; ind++) {
+        const uint8_t *data = (const uint8_t *)segs[ind].data;
+        uint16_t size = segs[ind].size;
 
-    if (peekCount > 0) {
-        uint8_t ind=0;
-        if (peeked) {
-            str++;
-            ind = 1;
-        }
-        for (; ind<peekCount; ind++) {
-            uint8_t pind = peekTail + ind;
-            next = pgm_read_byte(str++);
-
-            if (next == '\0') {
-                /* Done - got a match */
-                peekCount = 0; // discard peeked bytes
-                peekTail = 0;
-                peekHead = 0;
-                return true;
+        if (segs[ind].progmem) {
+            if (size == 0) {
+                size = strlen_P((const char *)data);
             }
-
-            if (pind > sizeof(peekBuf)) {
-                pind = 0;
+            for (uint16_t pos=0; pos < size; pos++) {
+                write((uint8_t)pgm_read_byte(&data[pos]));
             }
-            if (peekBuf[pind] != next) {
-                /* Not a match */
-                return false;
+        } else {
+            if (size == 0) {
+                size = strlen((const char *)data);
             }
-            /* peeked characters match */
+            write(data, size);
         }
+        total += size;
+    }
+    txBuffering = buffering;
 
-        /* string matched so far, keep reading */
-    } else if (!peeked) {
-        /* Already read and matched the first character before being called */
-        str++;
+    if (!txBuffering) {
+        txFlush();
     }
+    return total;
+}
 
-    next = pgm_read_byte(str++);
-    while (readTimeout(&peekBuf[peekHead]),50) {
-        if (peekBuf[peekHead] != next) {
-            if (++peekHead >= sizeof(peekBuf)) {
-                peekHead = 0;
-            }
-            peekCount++;
-            if (peekCount > sizeof(peekBuf)) {
-                debug.println(F("ERROR peek.1 buffer overlow"));
-            }
-            break;
+/**
+ * Stage data mode writes in the transmit buffer, so that data written a
+ * byte at a time (e.g. by print()) reaches the serial interface in
+ * blocks. Staged data is sent when the buffer fills, by flush(), by
+ * read() and available(), and before the WiFly changes mode.
+ */
+void WiFly::enableWriteBuffering()
+{
+    txBuffering = true;
+}
+
+/** Send data mode writes straight to the serial interface */
+void WiFly::disableWriteBuffering()
+{
+    txFlush();
+    txBuffering = false;
+}
+
+/* TCP state markers sent by the WiFly in data mode, and *READY* on waking */
+#define WIFLY_MARKER_OPEN    0x01
+#define WIFLY_MARKER_CLOSE   0x02
+#define WIFLY_MARKER_READY   0x04
+
+/* A partial marker not completed within this many milliseconds is data */
+#define WIFLY_MARKER_TIMEOUT 50
+
+#define WIFLY_RX_MASK        (WIFLY_RX_BUFFER_SIZE - 1)
+
+static const char markers[][8] PROGMEM = {
+    "*OPEN*",
+    "*CLOS*",
+    "*READY*",
+};
+
+/** Add a byte to the read-ahead buffer */
+void WiFly::rxPut(char ch)
+{
+    rxBuf[rxHead] = ch;
+    rxHead = (rxHead + 1) & WIFLY_RX_MASK;
+    rxCount++;
+}
+
+/** Remove the next byte from the read-ahead buffer */
+uint8_t WiFly::rxGet()
+{
+    uint8_t data = (uint8_t)rxBuf[rxTail];
+    rxTail = (rxTail + 1) & WIFLY_RX_MASK;
+    rxCount--;
+    return data;
+}
+
+/**
+ * Return the next byte that a read() would return, but leave the
+ * byte in the receive buffer.
+ * @returns the next byte that would be read 
+ * @retval -1 - no data in receive buffer
+ */
+int WiFly::peek()
+{
+    return peek(0);
+}
+
+/**
+ * Look ahead in the received data without removing it. Data waiting
+ * on the serial interface is moved into the read-ahead buffer as
+ * needed, so offsets up to WIFLY_RX_BUFFER_SIZE-1 can be inspected.
+ * Does not wait for data to arrive.
+ * @param offset the number of bytes to look past, 0 for the next byte
+ * @returns the byte at offset in the received data
+ * @retval -1 - that byte has not been received yet, or is past the
+ *              end of the read-ahead buffer
+ */
+int WiFly::peek(uint8_t offset)
+{
+    if (offset >= rxCount) {
+        rxFill();
+        if (offset >= rxCount) {
+            return -1;
         }
-        if (++peekHead >= sizeof(peekBuf)) {
-            peekHead = 0;
+    }
+    return (uint8_t)rxBuf[(rxTail + offset) & WIFLY_RX_MASK];
+}
+
+/**
+ * Pass a byte from the WiFly through the TCP marker detector.
+ * Bytes that can't be part of a marker go straight to the read-ahead
+ * buffer. Bytes that could be are held (as a count of matched marker
+ * characters) until the marker completes or fails to match, so the
+ * detector never has to wait for the rest of a marker to arrive.
+ * Only *CLOS* is looked for while connected, and only *OPEN* while not.
+ * *READY* is also looked for while the WiFly is asleep, so a sketch
+ * reading data doesn't hide the wake from wakeComplete().
+ * @param ch the byte to check
+ * @returns the marker completed by this byte, or 0
+ */
+uint8_t WiFly::markerFeed(char ch)
+{
+    uint8_t mask = 0;
+
+    if (markerLen == 0) {
+        if (ch != '*') {
+            rxPut(ch);
+            return 0;
         }
-        peekCount++;
-        if (peekCount > sizeof(peekBuf)) {
-            debug.println(F("ERROR peek.2 buffer overlow"));
+        markerMask = connected ? WIFLY_MARKER_CLOSE : WIFLY_MARKER_OPEN;
+        if (sleeping) {
+            markerMask |= WIFLY_MARKER_READY;
         }
-        next = pgm_read_byte(str++);
-        if (next == '\0') {
-            /* Done - got a match */
-            peekCount = 0; // discard peeked bytes
-            peekTail = 0;
-            peekHead = 0;
-            return true;
+        markerLen = 1;
+        markerTime = clock->millis();
+        return 0;
+    }
+
+    for (uint8_t ind=0; ind < (sizeof(markers)/sizeof(markers[0])); ind++) {
+        if ((markerMask & (1 << ind)) && (pgm_read_byte(&markers[ind][markerLen]) == ch)) {
+            mask |= 1 << ind;
+            if (pgm_read_byte(&markers[ind][markerLen+1]) == '\0') {
+                /* Got a complete marker */
+                markerLen = 0;
+                if (mask == WIFLY_MARKER_READY) {
+                    awake(true);
+                    DPRINTLN(F("Woke"));
+                } else if (mask == WIFLY_MARKER_CLOSE) {
+                    connected = false;
+                    closed = true;
+                    status.tcp = WIFLY_TCP_IDLE;
+                    DPRINTLN(F("Stream closed"));
+                } else {
+                    connected = true;
+                    closed = false;
+                    status.tcp = WIFLY_TCP_CONNECTED;
+                    status.assoc = 1;
+                    DPRINTLN(F("Stream opened"));
+                }
+                return mask;
+            }
         }
     }
 
-    return false;
+    if (mask) {
+        /* still matching */
+        markerMask = mask;
+        markerLen++;
+        markerTime = clock->millis();
+        return 0;
+    }
+
+    /* Not a marker, the held bytes are data. This byte may start a new marker. */
+    markerRelease();
+    return markerFeed(ch);
 }
 
-/** Check for stream close, if its closed
- * we will quickly receive *CLOS* from the WiFly
- * @param peeked - set to true if first character of *CLOS* was peeked, or false if it has been read.
- * @retval true - stream closed
- * @retval false - stream not closed
- */
-boolean WiFly::checkClose(boolean peeked)
+/** Move the bytes of a partially matched marker to the read-ahead buffer */
+void WiFly::markerRelease()
 {
-    if (checkStream(F("*CLOS*"), peeked)) {
-        connected = false;
-        DPRINTLN(F("Stream closed"));
-        return true;
+    uint8_t ind = 0;
+
+    if (markerLen == 0) {
+        return;
     }
-    return false;
+
+    /* All candidates share the matched prefix, use the first one */
+    while (!(markerMask & (1 << ind))) {
+        ind++;
+    }
+    for (uint8_t pos=0; pos < markerLen; pos++) {
+        rxPut(pgm_read_byte(&markers[ind][pos]));
+    }
+    markerLen = 0;
 }
 
-/** Check for stream open.
- * @param peeked - set to true if first character of *OPEN* was peeked, or false if it has been read.
- * @retval true - stream opened
- * @retval false - stream not opened
+/**
+ * Move bytes that are waiting on the serial interface through the
+ * marker detector into the read-ahead buffer. Never waits for data.
+ * A partial marker that has not completed within WIFLY_MARKER_TIMEOUT
+ * is released as data.
  */
-boolean WiFly::checkOpen(boolean peeked)
+void WiFly::rxFill()
 {
-    if (checkStream(F("*OPEN*"), peeked)) {
-        connected = true;
-        DPRINTLN(F("Stream opened"));
-        return true;
+    /* leave room to release a partial marker and the byte that broke it */
+    while ((rxCount + markerLen + 1 <= WIFLY_RX_BUFFER_SIZE) && (serial->available() > 0)) {
+        markerFeed(serial->read());
+    }
+
+    if (markerLen && (clock->millis() - markerTime >= WIFLY_MARKER_TIMEOUT)
+        && (serial->available() <= 0)) {
+        markerRelease();
     }
-    return false;
 }
 
 /** Read the next byte from the WiFly.
@@ -596,34 +922,78 @@ boolean WiFly::checkOpen(boolean peeked)
  */
 int WiFly::read()
 {
-    int data = -1;
+    /* The reply may depend on data still staged */
+    if (txCount) {
+        txFlush();
+    }
 
-    /* Any data in peek buffer? */
-    if (peekCount) {
-        data = (uint8_t)peekBuf[peekTail++];
-        if (peekTail >= sizeof(peekBuf)) {
-            peekTail = 0;
+    if ((rxCount == 0) && (markerLen == 0)) {
+        /* Fast path, nothing held back */
+        int data = serial->read();
+        if (data != '*') {
+            return data;
         }
-        peekCount--;
-    } else {
-        data = serial->read();
-        /* TCP connected? Check for close */
-        if (connected && data == '*') {
-            if (checkClose(false)) {
-                return -1;
-            } else {
-                data = (uint8_t)peekBuf[peekTail++];
-                if (peekTail >= sizeof(peekBuf)) {
-                    peekTail = 0;
-                }
-                peekCount--;
+        markerFeed(data);
+    }
+
+    if (rxCount == 0) {
+        rxFill();
+    }
+    if (rxCount == 0) {
+        return -1;
+    }
+
+    return rxGet();
+}
+
+/**
+ * Read as many bytes as are available, up to size, without waiting.
+ * Bytes held in the read-ahead buffer are returned first, then the
+ * serial interface is drained directly into buf. A *CLOS* from the
+ * WiFly ends the read; it is detected even if it spans two calls.
+ * @param buf the buffer to read into
+ * @param size the size of the buffer
+ * @returns the number of bytes read into buf
+ * @retval -1 - the active TCP connection was closed and no bytes were read
+ */
+int WiFly::read(uint8_t *buf, size_t size)
+{
+    size_t count = 0;
+    int data;
+
+    txFlush();
+
+    while (count < size) {
+        /* Any data in read-ahead buffer? */
+        if (rxCount) {
+            buf[count++] = rxGet();
+            continue;
+        }
+
+        if (serial->available() <= 0) {
+            /* A partial marker may have timed out */
+            rxFill();
+            if (rxCount) {
+                continue;
             }
+            break;
+        }
+        data = serial->read();
+
+        if ((data != '*') && (markerLen == 0)) {
+            buf[count++] = (uint8_t)data;
+        } else if (markerFeed(data) == WIFLY_MARKER_CLOSE) {
+            break;
         }
     }
 
-    return data;
-}
+    if ((count == 0) && closed) {
+        closed = false;
+        return -1;
+    }
 
+    return count;
+}
 
 /** Check to see if data is available to be read.
  * @returns the number of bytes that are available to read.
@@ -632,34 +1002,29 @@ int WiFly::read()
  */
 int WiFly::available()
 {
-    int count;
+    /* A sketch polling for a reply must not leave its request staged */
+    if (txCount) {
+        txFlush();
+    }
 
-    count = serial->available();
-    if (count > 0) {
-        if (debugOn) {
-            debug.print(F("available: peek = "));
-            debug.println((char)serial->peek());
-        }
-        /* Check for TCP stream closure */
-        if (serial->peek() == '*') {
-            if (connected) {
-                if (checkClose(true)) {
-                    return -1;
-                } else {
-                    return peekCount + serial->available();
-                }
-            } else {
-                checkOpen(true);
-                return peekCount + serial->available();
-            }
-        }
+    /* Only need to look ahead if a marker may be arriving */
+    if (markerLen || ((rxCount == 0) && (serial->peek() == '*'))) {
+        rxFill();
+    }
+
+    if ((rxCount == 0) && closed) {
+        /* report the close once */
+        closed = false;
+        return -1;
     }
 
-    return count+peekCount;
+    return rxCount + serial->available();
 }
 
+/** Send any staged data and wait for the serial interface to send it */
 void WiFly::flush()
 {
+   txFlush();
    serial->flush();
 }
   
@@ -769,20 +1134,28 @@ void WiFly::dbgDump()
  */
 boolean WiFly::readTimeout(char *chp, uint16_t timeout)
 {
-    uint32_t start = millis();
+    uint32_t start = 0;
+    boolean waiting = false;
     char ch;
 
-    static int ind=0;
+    /* Anything staged may be what we're waiting for a reply to */
+    txFlush();
 
-    while (millis() - start < timeout) {
-        if (serial->available() > 0) {
-            ch = serial->read();
+    /* Bytes held back by the marker detector are read first */
+    if (markerLen) {
+        markerRelease();
+    }
+
+    for (;;) {
+        int data = rxCount ? rxGet() : serial->read();
+        if (data >= 0) {
+            ch = data;
             *chp = ch;
             if (dbgInd < dbgMax) {
                 dbgBuf[dbgInd++] = ch;
             }
             if (debugOn) {
-                debug.print(ind++);
+                debug.print(dbgRead++);
                 debug.print(F(": "));
                 debug.print(ch,HEX);
                 if (isprint(ch)) {
@@ -793,6 +1166,15 @@ boolean WiFly::readTimeout(char *chp, uint16_t timeout)
             }
             return true;
         }
+
+        /* Only read the clock once we have to wait for data */
+        if (!waiting) {
+            start = clock->millis();
+            waiting = true;
+        } else if (clock->millis() - start >= timeout) {
+            break;
+        }
+        clock->idle();
     }
 
     if (debugOn) {
@@ -802,25 +1184,22 @@ boolean WiFly::readTimeout(char *chp, uint16_t timeout)
     return false;
 }
 
-static char prompt[16];
-static boolean gotPrompt = false;
-
 /** Scan the input data for the WiFLy prompt.  This is a string starting with a '<' and
  * ending with a '>'. Store the prompt for future use.
  */
-boolean WiFly::setPrompt()
+boolean WiFly::setPrompt(uint16_t timeout)
 {
     char ch;
 
-    while (readTimeout(&ch,500)) {
+    while (readTimeout(&ch,timeout)) {
         if (ch == '<') {
             uint8_t ind = 1;
             prompt[0] = ch;
             while (ind < (sizeof(prompt)-4)) {
-                if (readTimeout(&ch,500)) {
+                if (readTimeout(&ch,timeout)) {
                     prompt[ind++] = ch;
                     if (ch == '>') {
-                        if (readTimeout(&ch,500)) {
+                        if (readTimeout(&ch,timeout)) {
                             if (ch == ' ') {
                                 prompt[ind++] = ch;
                                 //prompt[ind++] = '\r';
@@ -862,6 +1241,102 @@ boolean WiFly::checkPrompt(const char *str)
     }
 }
 
+/** Read a character of a string in RAM or in progmem */
+static inline char strByte(const char *str, uint8_t ind, boolean flash)
+{
+    return flash ? (char)pgm_read_byte(&str[ind]) : str[ind];
+}
+
+/**
+ * Advance a match of a string by one character, without a prefix
+ * table. After a mismatch the longest prefix of str that ends the input
+ * is found by comparing str against itself, which only costs anything
+ * when a partial match breaks.
+ * @param str the string to match
+ * @param matched the number of characters of str matched so far
+ * @param ch the next input character
+ * @param flash true if str is in progmem, false if it is in RAM
+ * @returns the number of characters of str matched, including ch
+ */
+static uint8_t matchStep(const char *str, uint8_t matched, char ch, boolean flash=true)
+{
+    if (strByte(str, matched, flash) == ch) {
+        return matched + 1;
+    }
+
+    for (uint8_t len=matched; len > 0; len--) {
+        /* Does the input end with str[0..len)? */
+        uint8_t shift = matched + 1 - len;
+        uint8_t ind;
+
+        if (strByte(str, len-1, flash) != ch) {
+            continue;
+        }
+        for (ind=0; ind < len-1; ind++) {
+            if (strByte(str, ind, flash) != strByte(str, shift+ind, flash)) {
+                break;
+            }
+        }
+        if (ind == len-1) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read characters from the WiFly until str is matched, using a prefix
+ * table so that matched input is never rescanned. After a mismatch the
+ * table gives the longest prefix of str that is also a suffix of what
+ * has been matched so far, and matching continues from there.
+ * Strings longer than WIFLY_MATCH_TABLE are matched with matchStep()
+ * instead, so the table never takes more stack than that.
+ * @param str The string to match
+ * @param len the length of str, not zero
+ * @param flash true if str is in progmem, false if it is in RAM
+ * @param timeout fail if no data received for this period (in milliseconds).
+ * @retval true - a match was found
+ * @retval false - no match found, timeout reached
+ */
+boolean WiFly::kmpMatch(const char *str, uint8_t len, boolean flash, uint16_t timeout)
+{
+    boolean table = (len <= WIFLY_MATCH_TABLE);
+    uint8_t prefix[table ? len : 1];
+    uint8_t matched = 0;
+    char ch;
+
+    prefix[0] = 0;
+    for (uint8_t ind=1; table && (ind<len); ind++) {
+        char next = strByte(str, ind, flash);
+        while ((matched > 0) && (next != strByte(str, matched, flash))) {
+            matched = prefix[matched-1];
+        }
+        if (next == strByte(str, matched, flash)) {
+            matched++;
+        }
+        prefix[ind] = matched;
+    }
+
+    matched = 0;
+    while (readTimeout(&ch,timeout)) {
+        if (!table) {
+            matched = matchStep(str, matched, ch, flash);
+        } else {
+            while ((matched > 0) && (ch != strByte(str, matched, flash))) {
+                matched = prefix[matched-1];
+            }
+            if (ch == strByte(str, matched, flash)) {
+                matched++;
+            }
+        }
+        if (matched == len) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 /**
  * Read characters from the WiFly and match them against the
  * string. Ignore any leading characters that don't match. Keep
@@ -874,8 +1349,7 @@ boolean WiFly::checkPrompt(const char *str)
  */
 boolean WiFly::match(const char *str, uint16_t timeout)
 {
-    const char *match = str;
-    char ch;
+    size_t len;
 
 #ifdef DEBUG
     if (debugOn) {
@@ -884,24 +1358,19 @@ boolean WiFly::match(const char *str, uint16_t timeout)
     }
 #endif
 
-    if ((match == NULL) || (*match == '\0')) {
+    if ((str == NULL) || (*str == '\0')) {
         return true;
     }
 
-    /* find first character */
-    while (readTimeout(&ch,timeout)) {
-        if (ch == *match) {
-            match++;
-        } else {
-            match = str;
-            if (ch == *match) {
-                match++;
-            }
-        }
-        if (*match == '\0') {
-            DPRINT(F("match: true\r\n"));
-            return true;
-        }
+    len = strlen(str);
+    if (len > 255) {
+        debug.println(F("match: string too long"));
+        return false;
+    }
+
+    if (kmpMatch(str, len, false, timeout)) {
+        DPRINT(F("match: true\r\n"));
+        return true;
     }
 
     DPRINT(F("match: false\r\n"));
@@ -925,40 +1394,182 @@ boolean WiFly::match_P(const __FlashStringHelper  *str, uint16_t timeout)
 
 boolean WiFly::match_P(const char  *str, uint16_t timeout)
 {
-    const char *match = (const char *)str;
-    char ch, ch_P;
+    size_t len;
 
     if (debugOn) {
         debug.print(F("match_P: "));
         debug.println((const __FlashStringHelper *)str);
     }
 
-    ch_P = pgm_read_byte(str);
-    if (ch_P == '\0') {
+    len = strlen_P(str);
+    if (len == 0) {
         /* Null string always matches */
         return true;
     }
+    if (len > 255) {
+        debug.println(F("match_P: string too long"));
+        return false;
+    }
 
-    while (readTimeout(&ch,timeout)) {
-        if (ch == ch_P) {
-            match++;
-        } else {
-            /* Restart match */
-            match = (const char *)str;
-            if (ch == pgm_read_byte(match)) {
-                match++;
-            }
+    if (kmpMatch(str, len, true, timeout)) {
+        DPRINT(F("match_P: true\r\n"));
+        return true;
+    }
+
+    DPRINT(F("match_P: false\r\n"));
+    return false;
+}
+
+/**
+ * Get the number of nodes needed to compile a set of progmem strings.
+ * @param str - the array of progmem strings
+ * @param count - the number of strings in the str array
+ * @returns the number of nodes, at most 255
+ */
+uint8_t WFMatcher::nodesNeeded(const char *str[], uint8_t count)
+{
+    uint16_t size = 1;    /* root */
+
+    for (uint8_t ind=0; ind<count; ind++) {
+        size += strlen_P(str[ind]);
+    }
+
+    return size > 255 ? 255 : size;
+}
+
+/**
+ * Compile a set of progmem strings for matching.
+ * The trie is built one level at a time so that every node is created
+ * after all of the shorter prefixes, which lets each node's mismatch
+ * link be set as it is created.
+ * @param nodes - storage for the compiled strings, see nodesNeeded()
+ * @param maxNodes - the number of entries in nodes
+ * @param str - the array of progmem strings to match
+ * @param count - the number of strings in the str array
+ * @retval true - success
+ * @retval false - not enough nodes for the strings
+ */
+boolean WFMatcher::begin(Node *nodes, uint8_t maxNodes, const char *str[], uint8_t count)
+{
+    uint8_t cur[count];    /* node each string has reached */
+    uint8_t depth;
+    uint8_t levelStart;
+    uint8_t ind;
+    boolean more = true;
+
+    this->nodes = nodes;
+    state = 0;
+    used = 1;
+
+    nodes[0].ch = 0;
+    nodes[0].child = 0;
+    nodes[0].sibling = 0;
+    nodes[0].fail = 0;
+    nodes[0].match = -1;
+
+    for (ind=0; ind<sizeof(first); ind++) {
+        first[ind] = 0;
+    }
+
+    for (ind=0; ind<count; ind++) {
+        uint8_t ch = pgm_read_byte(str[ind]);
+        first[ch >> 3] |= 1 << (ch & 7);
+        cur[ind] = 0;
+    }
+
+    for (depth=0; more; depth++) {
+        more = false;
+        levelStart = used;
+
+        for (ind=0; ind<count; ind++) {
+            uint8_t parent = cur[ind];
+            uint8_t node;
+            char ch;
+
+            if ((depth > 0) && (parent == 0)) {
+                /* string already finished */
+                continue;
+            }
+            ch = pgm_read_byte(str[ind] + depth);
+            if (ch == '\0') {
+                /* empty string */
+                continue;
+            }
+
+            /* existing child? */
+            for (node = nodes[parent].child; node != 0; node = nodes[node].sibling) {
+                if (nodes[node].ch == ch) {
+                    break;
+                }
+            }
+
+            if (node == 0) {
+                if (used >= maxNodes) {
+                    return false;
+                }
+                node = used++;
+                nodes[node].ch = ch;
+                nodes[node].child = 0;
+                nodes[node].match = -1;
+                nodes[node].fail = (parent == 0) ? 0 : next(nodes[parent].fail, ch);
+                nodes[node].sibling = nodes[parent].child;
+                nodes[parent].child = node;
+            }
+
+            if (pgm_read_byte(str[ind] + depth + 1) == '\0') {
+                /* lowest index wins if two strings are the same */
+                if (nodes[node].match < 0) {
+                    nodes[node].match = ind;
+                }
+                cur[ind] = 0;
+            } else {
+                cur[ind] = node;
+                more = true;
+            }
         }
 
-        ch_P = pgm_read_byte(match);
-        if (ch_P == '\0') {
-            DPRINT(F("match_P: true\r\n"));
-            return true;
+        /* A node also matches any string that is a suffix of it */
+        for (ind=levelStart; ind<used; ind++) {
+            int8_t suffix = nodes[nodes[ind].fail].match;
+            if ((suffix >= 0) && ((nodes[ind].match < 0) || (suffix < nodes[ind].match))) {
+                nodes[ind].match = suffix;
+            }
         }
     }
 
-    DPRINT(F("match_P: false\r\n"));
-    return false;
+    return true;
+}
+
+/** Get the node reached from node by ch, following mismatch links as needed */
+uint8_t WFMatcher::next(uint8_t node, char ch)
+{
+    for (;;) {
+        for (uint8_t child = nodes[node].child; child != 0; child = nodes[child].sibling) {
+            if (nodes[child].ch == ch) {
+                return child;
+            }
+        }
+        if (node == 0) {
+            return 0;
+        }
+        node = nodes[node].fail;
+    }
+}
+
+/**
+ * Match the next character of the input.
+ * @param ch - the next character
+ * @returns the index of the string that ends at this character
+ * @retval -1 - no string matched yet
+ */
+int8_t WFMatcher::step(char ch)
+{
+    if ((state == 0) && !(first[(uint8_t)ch >> 3] & (1 << (ch & 7)))) {
+        /* can't start a string, nothing to search */
+        return -1;
+    }
+    state = next(state, ch);
+    return nodes[state].match;
 }
 
 /**
@@ -1007,17 +1618,13 @@ int WiFly::multiMatch_P(uint16_t timeout, uint8_t count, ...)
  */
 int8_t WiFly::multiMatch_P(const char *str[], uint8_t count, uint16_t timeout)
 {
-    struct {
-        bool active;
-        const char *str;
-    } match[count];
-    char ch, ch_P;
-    uint8_t ind;
+    WFMatcher matcher;
+    WFMatcher::Node nodes[WFMatcher::nodesNeeded(str, count)];
+    char ch;
+    int8_t res;
 
-    for (ind=0; ind<count; ind++) {
-        match[ind].active = false;
-        match[ind].str = str[ind];
-        if (debugOn) {
+    if (debugOn) {
+        for (uint8_t ind=0; ind<count; ind++) {
             debug.print(F("multiMatch_P: "));
             debug.print(ind);
             debug.print(' ');
@@ -1025,25 +1632,17 @@ int8_t WiFly::multiMatch_P(const char *str[], uint8_t count, uint16_t timeout)
         }
     }
 
-    while (readTimeout(&ch,timeout)) {
-        for (ind=0; ind<count; ind++) {
-            ch_P = pgm_read_byte(match[ind].str);
-            if (ch == ch_P) {
-                match[ind].str++;
-            } else {
-                /* Restart match */
-                match[ind].str = str[ind];
-                /* unmatched character might be the start of the string */
-                if (ch == pgm_read_byte(match[ind].str)) {
-                    match[ind].str++;
-                }
-            }
+    if (!matcher.begin(nodes, sizeof(nodes)/sizeof(nodes[0]), str, count)) {
+        DPRINTLN(F("multiMatch_P: strings too long"));
+        return -1;
+    }
 
-            if (pgm_read_byte(match[ind].str) == '\0') {
-                /* Got a match */
-                DPRINTLN(F("multiMatch_P: true"));
-                return ind;
-            }
+    while (readTimeout(&ch,timeout)) {
+        res = matcher.step(ch);
+        if (res >= 0) {
+            /* Got a match */
+            DPRINTLN(F("multiMatch_P: true"));
+            return res;
         }
     }
 
@@ -1084,7 +1683,7 @@ boolean WiFly::getPrompt(uint16_t timeout)
     if (!gotPrompt) {
         DPRINT(F("setPrompt\r\n"));
 
-        res = setPrompt();
+        res = setPrompt(timeout);
         if (!res) {
             debug.println(F("setPrompt failed"));
         }
@@ -1095,54 +1694,129 @@ boolean WiFly::getPrompt(uint16_t timeout)
     return res;
 }
 
-/** Put the WiFly into command mode */
-boolean WiFly::enterCommandMode()
+/**
+ * Wait until nothing has been written to the WiFly for the guard time
+ * (or the WiFly's comm time, if that is longer), so that a $$$ that
+ * follows is seen as a command mode escape and not as data. Usually
+ * the line has been idle long enough already and there is no wait.
+ */
+void WiFly::guardWait()
 {
-    uint8_t retry;
+    uint16_t left = guardLeft();
 
-    if (inCommandMode) {
-        return true;
+    if (left) {
+        clock->delay(left);
     }
+}
 
-    delay(250);
-    send_P(F("$$$"));
-    delay(250);
-    if (match_P(F("CMD\r\n"), 500)) {
-        /* Get the prompt */
-        if (gotPrompt) {
-            inCommandMode = true;
-            return true;
-        } else {
-            for (retry=0; retry < 5; retry++) {
-                serial->write('\r');
-                if (getPrompt()) {
-                    inCommandMode = true;
-                    return true;
-                }
-            }
-        }
+/** Milliseconds until the line has been idle for the guard time */
+uint16_t WiFly::guardLeft()
+{
+    uint16_t guard = (flushTime > guardTime) ? flushTime : guardTime;
+    uint32_t idle = clock->millis() - lastTx;
+
+    return (idle <= guard) ? guard + 1 - idle : 0;
+}
+
+/**
+ * Send \r and see if the WiFly answers with a prompt, which it does
+ * if it is already in command mode. If it doesn't, the time spent
+ * waiting has also served as the guard time before $$$. Nothing is
+ * sent while a connection is open, where the \r would be data.
+ * @retval true - the WiFly is in command mode
+ */
+boolean WiFly::probePrompt()
+{
+    if (connected) {
+        return false;
     }
 
-    /* See if we're already in command mode */
     DPRINT(F("Check in command mode\r\n"));
     serial->write('\r');
-    if (getPrompt()) {
+    lastTx = clock->millis();
+    if (getPrompt(guardTime)) {
         inCommandMode = true;
+        modeKnown = true;
         DPRINT(F("Already in command mode\r\n"));
         return true;
     }
+    return false;
+}
+
+/**
+ * Send $$$ once the line has been idle for the guard time, and wait for
+ * the WiFly to confirm command mode. The WiFly only replies once the
+ * line has been idle for the guard time after the $$$, so waiting for
+ * the reply takes the place of a fixed delay.
+ * @retval true - the WiFly is in command mode
+ */
+boolean WiFly::sendEscape()
+{
+    guardWait();
+    send_P(F("$$$"));
+    txFlush();
+
+    if (!match_P(F("CMD\r\n"), guardTime + WIFLY_DEFAULT_TIMEOUT)) {
+        return false;
+    }
+
+    /* Get the prompt */
+    if (!gotPrompt) {
+        for (uint8_t retry=0; retry < 5; retry++) {
+            serial->write('\r');
+            lastTx = clock->millis();
+            if (getPrompt()) {
+                break;
+            }
+        }
+        if (!gotPrompt) {
+            /* Commands can't be used without it, go back to data mode for the retry */
+            send_P(F("exit\r"));
+            if (!match_P(F("EXIT\r\n"), WIFLY_DEFAULT_TIMEOUT)) {
+                modeKnown = false;
+            }
+            return false;
+        }
+    }
+    inCommandMode = true;
+    modeKnown = true;
+    return true;
+}
+
+/**
+ * Put the WiFly into command mode. $$$ is sent as soon as the line has
+ * been idle for the guard time, rather than after a fixed delay. If the
+ * WiFly doesn't answer it, check whether it is already in command mode.
+ * The check sends \r, so it isn't tried first: the WiFly may still have
+ * a connection open that this side doesn't know about (e.g. after the
+ * sketch restarts), and the \r would reach the peer as data.
+ */
+boolean WiFly::enterCommandMode()
+{
+    uint8_t retry;
+
+    if (inCommandMode) {
+        return true;
+    }
 
-    for (retry=0; retry<5; retry++) {
+    /* Staged data must go out before the guard time */
+    txFlush();
+
+    for (retry=0; retry<6; retry++) {
         DPRINT(F("send $$$ ")); DPRINT(retry); DPRINT("\r\n");
-        delay(250);
-        send_P(F("$$$"));
-        delay(250);
-        if (match_P(F("CMD\r\n"), 500)) {
-            inCommandMode = true;
+        if (sendEscape()) {
             return true;
         }
+        if (retry == 0) {
+            /* See if we're already in command mode */
+            modeKnown = false;
+            if (probePrompt()) {
+                return true;
+            }
+        }
     }
 
+    modeKnown = false;
     return false;
 }
 
@@ -1159,6 +1833,7 @@ boolean WiFly::exitCommandMode()
         inCommandMode = false;
         return true;
     } else {
+        modeKnown = false;
         debug.println(F("Failed to exit\r\n"));
         return false;
     }
@@ -1241,6 +1916,24 @@ int WiFly::gets(char *buf, int size, uint16_t timeout)
 /* Get the WiFly ready to receive a command. */
 boolean WiFly::startCommand()
 {
+    /* Commands are lost on a WiFly that is still asleep or booting */
+    if (asleep()) {
+        DPRINT(F("startCommand: asleep\r\n"));
+        return false;
+    }
+
+    /* Let queued commands finish first */
+    while (busy()) {
+        if (poll()) {
+            clock->idle();
+        }
+    }
+
+    /* Replies to batched set commands come before this command's reply */
+    while (batchPending) {
+        batchCollect();
+    }
+
     if (!inCommandMode) {
         if (!enterCommandMode()) {
             return false;
@@ -1265,11 +1958,219 @@ boolean WiFly::finishCommand()
     return true;
 }
 
+/**
+ * Serve option reads from a configuration snapshot. Options that the
+ * WiFly reports with a "get" command are read for all of them with one
+ * "get everything" command and kept in cache until an option is set,
+ * the WiFly joins, leaves or reboots, invalidateConfig() is called, or
+ * the snapshot is older than ttl. Status that changes by itself (time,
+ * RSSI) is always read from the WiFly.
+ * @param cache - storage for the snapshot, NULL to stop caching
+ * @param ttl - milliseconds before the snapshot is read again, 0 for no limit
+ */
+void WiFly::setConfigCache(WFConfig *cache, uint32_t ttl)
+{
+    config = cache;
+    configTTL = ttl;
+    invalidateConfig();
+}
+
+/** Discard the configuration snapshot, it is read again when next needed */
+void WiFly::invalidateConfig()
+{
+    if (config) {
+        config->valid = false;
+    }
+}
+
+/* Section of "get everything" output that no option is read from */
+static const char sectionNone[] PROGMEM = "";
+
+/**
+ * Find the section of "get everything" output started by a header line,
+ * e.g. "IP:" for the options read by "get ip". The header may be longer
+ * than the section name in the request, e.g. "UART:" for "get u".
+ * @param header the header line
+ * @returns the request for the section, or sectionNone
+ */
+static const char *configSection(const char *header)
+{
+    for (uint8_t opt=0; opt<WIFLY_CONFIG_ITEMS; opt++) {
+        const char *req = requests[opt].req;
+        uint8_t ind = 0;
+        char ch;
+
+        if (pgm_read_byte(req) != 'g') {
+            continue;
+        }
+
+        /* skip "get " */
+        while (((ch = pgm_read_byte(&req[4+ind])) != '\r') && (tolower(header[ind]) == ch)) {
+            ind++;
+        }
+        if (ch == '\r') {
+            return req;
+        }
+    }
+    return sectionNone;
+}
+
+/**
+ * Store the value from one line of "get everything" output. Keys are
+ * only matched within their own section, as some are used in several
+ * (e.g. IP= in the broadcast section and the ip section).
+ * @param line the line to parse
+ * @param section the request for the section the line is in, or NULL
+ *        if the output has no section headers
+ */
+void WiFly::parseConfigLine(const char *line, const char *section)
+{
+    for (uint8_t opt=0; opt<WIFLY_CONFIG_ITEMS; opt++) {
+        const char *resp = requests[opt].resp;
+        uint8_t len;
+        uint8_t size;
+
+        if ((pgm_read_byte(requests[opt].req) != 'g') || config->value[opt]) {
+            /* not in the snapshot, or already have it */
+            continue;
+        }
+        if (section && (requests[opt].req != section)) {
+            continue;
+        }
+
+        len = strlen_P(resp);
+        if (strncmp_P(line, resp, len) == 0) {
+            size = strlen(&line[len]) + 1;
+            if (config->used + size <= sizeof(config->pool)) {
+                memcpy(&config->pool[config->used], &line[len], size);
+                config->value[opt] = config->used + 1;
+                config->used += size;
+            }
+        }
+    }
+}
+
+/**
+ * Read a configuration snapshot with "get everything", parsing each
+ * line as it arrives. See setConfigCache().
+ * @retval true - snapshot read
+ * @retval false - no cache set, or failed to read the configuration
+ */
+boolean WiFly::readConfig()
+{
+    char line[48];
+    uint8_t len = 0;
+    uint8_t promptLen = strlen(prompt);
+    const char *section = NULL;
+    boolean truncated = false;
+    boolean done = false;
+    char ch;
+
+    if (config == NULL) {
+        return false;
+    }
+
+    config->valid = false;
+    config->used = 0;
+    memset(config->value, 0, sizeof(config->value));
+
+    if (!startCommand()) {
+        return false;
+    }
+
+    send_P(F("get everything\r"));
+
+    while (!done && readTimeout(&ch, WIFLY_DEFAULT_TIMEOUT)) {
+        if (ch == '\r') {
+            continue;
+        }
+        if (ch == '\n') {
+            line[len] = '\0';
+            if (truncated) {
+                /* skip it */
+            } else if (len && (line[len-1] == ':') && (strchr(line, '=') == NULL)) {
+                /* a section header, e.g. "IP:" */
+                section = configSection(line);
+            } else {
+                parseConfigLine(line, section);
+            }
+            len = 0;
+            truncated = false;
+            continue;
+        }
+
+        if (len < sizeof(line)-1) {
+            line[len++] = ch;
+        } else {
+            /* don't store part of a value */
+            truncated = true;
+        }
+
+        /* The prompt ends the output, it has no newline */
+        if ((len == promptLen) && (line[0] == '<') && (strncmp(line, prompt, len) == 0)) {
+            done = true;
+        }
+    }
+
+    finishCommand();
+
+    if (!done) {
+        DPRINTLN(F("readConfig: no prompt"));
+        return false;
+    }
+
+    config->taken = clock->millis();
+    config->valid = true;
+    return true;
+}
+
+/**
+ * Get an option from the configuration snapshot, reading the snapshot
+ * first if it is missing or too old.
+ * @returns the value of the option
+ * @retval NULL - no snapshot, or the option isn't in it
+ */
+const char *WiFly::getCachedOpt(int opt)
+{
+    uint8_t offset;
+
+    if ((config == NULL) || (pgm_read_byte(requests[opt].req) != 'g')) {
+        return NULL;
+    }
+
+    if (config->valid && configTTL && (clock->millis() - config->taken >= configTTL)) {
+        config->valid = false;
+    }
+
+    if (!config->valid && !readConfig()) {
+        return NULL;
+    }
+
+    offset = config->value[opt];
+    if (offset == 0) {
+        return NULL;
+    }
+    return &config->pool[offset-1];
+}
+
 /* Get the value of an option */
 char *WiFly::getopt(int opt, char *buf, int size)
 {
+    const char *value = getCachedOpt(opt);
+
+    if (value != NULL) {
+        strncpy(buf, value, size);
+        buf[size-1] = '\0';
+        return buf;
+    }
+
     if (startCommand()) {
-        send_P(requests[opt].req);
+        if (optQueued & ((uint32_t)1 << opt)) {
+            /* sent earlier by queueGetopt() */
+            optQueued &= ~((uint32_t)1 << opt);
+        } else {
+            send_P(requests[opt].req);
+        }
 
         if (match_P(requests[opt].resp, 500)) {
             gets(buf, size);
@@ -1283,6 +2184,24 @@ char *WiFly::getopt(int opt, char *buf, int size)
     return (char *)"<error>";
 }
 
+/**
+ * Send a get request now and read its reply in a later getopt(), so
+ * that several requests are on their way at once. Must be used in a
+ * command mode session, and the replies read in the order the requests
+ * were sent. Options are left to getopt() when a configuration cache
+ * is in use.
+ * @param opt the request to send
+ */
+void WiFly::queueGetopt(int opt)
+{
+    uint32_t bit = (uint32_t)1 << opt;
+
+    if ((config == NULL) && !(optQueued & bit)) {
+        send_P(requests[opt].req);
+        optQueued |= bit;
+    }
+}
+
 /* Get WiFly connection status */
 uint16_t WiFly::getConnection()
 {
@@ -1298,7 +2217,12 @@ uint16_t WiFly::getConnection()
 
     DPRINT(F("getCon\r\n"));
     DPRINT(F("show c\r\n"));
-    send_P(F("show c\r"));
+    if (conQueued) {
+        /* sent earlier, with the setup in init() */
+        conQueued = false;
+    } else {
+        send_P(F("show c\r"));
+    }
     len = gets(buf, sizeof(buf));
 
     if (checkPrompt(buf)) {
@@ -1320,6 +2244,8 @@ uint16_t WiFly::getConnection()
     status.dnsServer = (res >> WIFLY_STATUS_DNS_SERVER_OFFSET) & WIFLY_STATUS_DNS_SERVER_MASK;
     status.dnsFound = (res >> WIFLY_STATUS_DNS_FOUND_OFFSET) & WIFLY_STATUS_DNS_FOUND_MASK;
     status.channel = (res >> WIFLY_STATUS_CHAN_OFFSET) & WIFLY_STATUS_CHAN_MASK;
+    statusValid = true;
+    statusTime = clock->millis();
 
     finishCommand();
 
@@ -1465,10 +2391,18 @@ uint32_t WiFly::getBaud()
 /**
  * This command puts the module to sleep. You can wake
  * the module by sending characters over the UART or by
- * using the wake timer (supplied in seconds).
+ * using the wake timer (supplied in seconds, 0 to keep
+ * the wake timer already set).
+ * Use wakeComplete() to see when it is awake; commands
+ * sent before then fail. If *READY* hasn't been seen
+ * WIFLY_BOOT_TIMEOUT after the wake timer expires (or
+ * after the sleep starts, with no wake timer), the
+ * WiFly is taken to be awake.
  */
 boolean WiFly::sleep(uint16_t seconds)
 {
+    uint32_t wake = seconds;
+
     if (seconds != 0) {
         if(!setopt(F("set sys wake"), seconds)) {
             return false;
@@ -1477,8 +2411,20 @@ boolean WiFly::sleep(uint16_t seconds)
     if (!startCommand()) {
         return false;
     }
+    if (seconds == 0) {
+        wake = getopt(WIFLY_GET_WAKE);
+    }
     send_P(F("sleep\r"));
+    txFlush();
     inCommandMode = false;
+    exitCommand = 0;
+
+    /* Commands wait for the *READY* it sends on waking */
+    sleeping = true;
+    statusValid = false;
+    readyLen = 0;
+    sleepStart = clock->millis();
+    wakeTime = wake * 1000;
     return true;
 }
 
@@ -1508,15 +2454,85 @@ uint32_t WiFly::getRTC()
     return getopt(WIFLY_GET_RTC);
 }
 
-/**
- * Do a DNS lookup to find the ip address of the specified hostname 
- * @param hostname - host to lookup
- * @param buf - buffer to return the ip address in
- * @param size - size of the buffer
- * @return true on success, false on failure
- */
+/** FNV-1a hash of a passphrase. Never 0. */
+static uint32_t passphraseHash(const char *phrase)
+{
+    uint32_t hash = 2166136261UL;
+
+    while (*phrase) {
+        hash ^= (uint8_t)*phrase++;
+        hash *= 16777619UL;
+    }
+    return hash ? hash : 1;
+}
+
+#if WIFLY_DNS_CACHE_SIZE > 0
+/** FNV-1a hash of a host name, ignoring case. Never 0. */
+static uint32_t dnsHash(const char *hostname)
+{
+    uint32_t hash = 2166136261UL;
+
+    while (*hostname) {
+        hash ^= (uint8_t)tolower(*hostname++);
+        hash *= 16777619UL;
+    }
+    return hash ? hash : 1;
+}
+#endif
+
+/** Forget all cached DNS lookups */
+void WiFly::flushDnsCache()
+{
+#if WIFLY_DNS_CACHE_SIZE > 0
+    for (uint8_t ind=0; ind < WIFLY_DNS_CACHE_SIZE; ind++) {
+        dnsCache[ind].hash = 0;
+    }
+#endif
+}
+
+/**
+ * Do a DNS lookup to find the ip address of the specified hostname.
+ * Addresses are cached for the DNS TTL (see setDnsTTL()), so repeated
+ * lookups of the same host don't need the WiFly. A cached entry is only
+ * used if its name matches as well as its hash.
+ * @param hostname - host to lookup
+ * @param buf - buffer to return the ip address in
+ * @param size - size of the buffer
+ * @return true on success, false on failure
+ */
 bool WiFly::getHostByName(const char *hostname, char *buf, int size)
 {
+#if WIFLY_DNS_CACHE_SIZE > 0
+    uint32_t hash = dnsHash(hostname);
+    uint32_t now = clock->millis();
+    uint8_t slot = 0;
+
+    for (uint8_t ind=0; ind < WIFLY_DNS_CACHE_SIZE; ind++) {
+        if (dnsCache[ind].hash == 0) {
+            slot = ind;
+            continue;
+        }
+        if ((now - dnsCache[ind].stored) >= dnsTTL) {
+            /* expired */
+            dnsCache[ind].hash = 0;
+            slot = ind;
+            continue;
+        }
+        if ((dnsCache[ind].hash == hash) &&
+            (strncasecmp(dnsCache[ind].name, hostname, sizeof(dnsCache[ind].name)-1) == 0)) {
+            dnsHits++;
+            iptoa(IPAddress(dnsCache[ind].addr), buf, size);
+            return true;
+        }
+        if ((dnsCache[slot].hash != 0) &&
+            ((now - dnsCache[ind].stored) > (now - dnsCache[slot].stored))) {
+            /* replace the oldest */
+            slot = ind;
+        }
+    }
+    dnsMisses++;
+#endif
+
     if (startCommand()) {
     send_P(F("lookup "));
     send(hostname);
@@ -1528,6 +2544,18 @@ bool WiFly::getHostByName(const char *hostname, char *buf, int size)
         gets(buf, size);
         getPrompt();
         finishCommand();
+#if WIFLY_DNS_CACHE_SIZE > 0
+        if (isDotQuad(buf)) {
+            IPAddress ip = atoip(buf);
+            for (uint8_t ind=0; ind<4; ind++) {
+                dnsCache[slot].addr[ind] = ip[ind];
+            }
+            dnsCache[slot].hash = hash;
+            dnsCache[slot].stored = clock->millis();
+            strncpy(dnsCache[slot].name, hostname, sizeof(dnsCache[slot].name)-1);
+            dnsCache[slot].name[sizeof(dnsCache[slot].name)-1] = '\0';
+        }
+#endif
         return true;
     }
 
@@ -1618,7 +2646,12 @@ uint16_t WiFly::getFlushTimeout()
 
 uint16_t WiFly::getFlushSize()
 {
-    return getopt(WIFLY_GET_FLUSHSIZE);
+    uint16_t size = getopt(WIFLY_GET_FLUSHSIZE);
+
+    if ((size > 0) && (size < txThreshold)) {
+        txThreshold = size;
+    }
+    return size;
 }
 
 uint8_t WiFly::getFlushChar()
@@ -1706,7 +2739,12 @@ boolean WiFly::setopt(const char *cmd, const char *buf, const char *buf_P, bool
     char rbuf[16];
     boolean res;
 
-    if (!startCommand()) {
+    if (batching) {
+        /* Already in command mode, limit the replies still to come */
+        if (batchPending >= WIFLY_BATCH_DEPTH) {
+            batchCollect();
+        }
+    } else if (!startCommand()) {
         return false;
     }
 
@@ -1745,11 +2783,746 @@ boolean WiFly::setopt(const char *cmd, const char *buf, const char *buf_P, bool
     }
     send('\r');
 
+    /* The snapshot may no longer match */
+    invalidateConfig();
+
+    if (batching) {
+        /* The result is collected later */
+        batchSent++;
+        batchPending++;
+        return true;
+    }
+
     res = getres(rbuf, sizeof(rbuf));
     getPrompt();
 
-    finishCommand();
-    return res;
+    finishCommand();
+    return res;
+}
+
+/**
+ * Bring the WiFly configuration in line with a profile. The current
+ * settings are read with a single "get everything", set commands are
+ * sent as one batch for only the settings that differ, and the
+ * configuration is saved only if something was changed.
+ * The passphrase can't be read back (the WiFly hides it), so it is set
+ * unless it is the one this WiFly object last set. Needs a
+ * configuration cache, see setConfigCache().
+ * @param profile - the settings to apply
+ * @param changed - if not NULL, set to the WIFLY_PROFILE_ flags of the
+ *                  settings that were changed
+ * @retval true - the WiFly matches the profile
+ * @retval false - no configuration cache, or failed to read, set or
+ *         save the configuration
+ */
+boolean WiFly::applyProfile(const WFProfile *profile, uint16_t *changed)
+{
+    uint32_t ttl = configTTL;
+    uint16_t fields = profile->fields;
+    uint16_t diff = 0;
+    boolean res = true;
+    char buf[33];
+
+    if (config == NULL) {
+        DPRINTLN(F("applyProfile: no config cache"));
+        return false;
+    }
+
+    if (!startCommand()) {
+        return false;
+    }
+
+    /* Compare against one snapshot */
+    configTTL = 0;
+
+    if ((fields & WIFLY_PROFILE_SSID) && (strcmp(getSSID(buf, sizeof(buf)), profile->ssid) != 0)) {
+        diff |= WIFLY_PROFILE_SSID;
+    }
+    if ((fields & WIFLY_PROFILE_AUTH) && (getAuth() != profile->auth)) {
+        diff |= WIFLY_PROFILE_AUTH;
+    }
+    if ((fields & WIFLY_PROFILE_DHCP) && (getDHCPMode() != profile->dhcpMode)) {
+        diff |= WIFLY_PROFILE_DHCP;
+    }
+    if ((fields & WIFLY_PROFILE_IP_FLAGS) && (getIpFlags() != profile->ipFlags)) {
+        diff |= WIFLY_PROFILE_IP_FLAGS;
+    }
+    if ((fields & WIFLY_PROFILE_PROTOCOL) && (getProtocol() != profile->protocol)) {
+        diff |= WIFLY_PROFILE_PROTOCOL;
+    }
+    if ((fields & WIFLY_PROFILE_PORT) && (getPort() != profile->port)) {
+        diff |= WIFLY_PROFILE_PORT;
+    }
+    if ((fields & WIFLY_PROFILE_HOST_IP) && (strcmp(getHostIP(buf, sizeof(buf)), profile->hostIP) != 0)) {
+        diff |= WIFLY_PROFILE_HOST_IP;
+    }
+    if ((fields & WIFLY_PROFILE_HOST_PORT) && (getHostPort() != profile->hostPort)) {
+        diff |= WIFLY_PROFILE_HOST_PORT;
+    }
+    if ((fields & WIFLY_PROFILE_UART_MODE) && (getUartMode() != profile->uartMode)) {
+        diff |= WIFLY_PROFILE_UART_MODE;
+    }
+    if ((fields & WIFLY_PROFILE_FLUSH_TIMEOUT) && (getFlushTimeout() != profile->flushTimeout)) {
+        diff |= WIFLY_PROFILE_FLUSH_TIMEOUT;
+    }
+    if ((fields & WIFLY_PROFILE_FLUSH_CHAR) && (getFlushChar() != (uint8_t)profile->flushChar)) {
+        diff |= WIFLY_PROFILE_FLUSH_CHAR;
+    }
+    if ((fields & WIFLY_PROFILE_FLUSH_SIZE) && (getFlushSize() != profile->flushSize)) {
+        diff |= WIFLY_PROFILE_FLUSH_SIZE;
+    }
+    if ((fields & WIFLY_PROFILE_PASSPHRASE) &&
+        ((diff & (WIFLY_PROFILE_SSID | WIFLY_PROFILE_AUTH)) || (passphraseHash(profile->passphrase) != passHash))) {
+        diff |= WIFLY_PROFILE_PASSPHRASE;
+    }
+
+    configTTL = ttl;
+
+    if (diff) {
+        beginBatch();
+        if (diff & WIFLY_PROFILE_SSID) {
+            setSSID(profile->ssid);
+        }
+        if (diff & WIFLY_PROFILE_AUTH) {
+            setAuth(profile->auth);
+        }
+        if (diff & WIFLY_PROFILE_PASSPHRASE) {
+            setPassphrase(profile->passphrase);
+        }
+        if (diff & WIFLY_PROFILE_DHCP) {
+            setDHCP(profile->dhcpMode);
+        }
+        if (diff & WIFLY_PROFILE_IP_FLAGS) {
+            setIpFlags(profile->ipFlags);
+        }
+        if (diff & WIFLY_PROFILE_PROTOCOL) {
+            setProtocol(profile->protocol);
+        }
+        if (diff & WIFLY_PROFILE_PORT) {
+            setPort(profile->port);
+        }
+        if (diff & WIFLY_PROFILE_HOST_IP) {
+            setHostIP(profile->hostIP);
+        }
+        if (diff & WIFLY_PROFILE_HOST_PORT) {
+            setHostPort(profile->hostPort);
+        }
+        if (diff & WIFLY_PROFILE_UART_MODE) {
+            setUartMode(profile->uartMode);
+        }
+        if (diff & WIFLY_PROFILE_FLUSH_TIMEOUT) {
+            setFlushTimeout(profile->flushTimeout);
+        }
+        if (diff & WIFLY_PROFILE_FLUSH_CHAR) {
+            setFlushChar(profile->flushChar);
+        }
+        if (diff & WIFLY_PROFILE_FLUSH_SIZE) {
+            setFlushSize(profile->flushSize);
+        }
+        res = endBatch();
+        if (!res) {
+            /* the passphrase may not have been set */
+            passHash = 0;
+        }
+
+        /* Keep whatever did change */
+        if (!save()) {
+            res = false;
+        }
+    }
+
+    finishCommand();
+
+    if (changed) {
+        *changed = diff;
+    }
+    return res;
+}
+
+/**
+ * Start a batch of set commands. Until endBatch(), the set functions
+ * send their command and return true without waiting for the reply, so
+ * that several commands reach the WiFly back to back in one command
+ * mode session. Up to WIFLY_BATCH_DEPTH replies are left outstanding.
+ * Any other command waits for the outstanding replies first.
+ * @retval true - the WiFly is in command mode and batching
+ * @retval false - failed to enter command mode, or already batching
+ */
+boolean WiFly::beginBatch()
+{
+    if (batching || !startCommand()) {
+        return false;
+    }
+
+    batching = true;
+    batchFailed = false;
+    batchSent = 0;
+    batchResults = 0;
+    return true;
+}
+
+/** Match the reply to the oldest outstanding batched command */
+boolean WiFly::batchCollect()
+{
+    char rbuf[16];
+    uint8_t ind = batchSent - batchPending;
+    boolean res;
+
+    batchPending--;
+    res = getres(rbuf, sizeof(rbuf));
+    getPrompt();
+
+    if (!res) {
+        batchFailed = true;
+    } else if (ind < 32) {
+        batchResults |= (uint32_t)1 << ind;
+    }
+    return res;
+}
+
+/**
+ * Finish a batch of set commands, collecting the remaining replies.
+ * @param results - if not NULL, set to a mask of the commands that
+ *                  succeeded: bit 0 for the first command, and so on
+ *                  for up to 32 commands.
+ * @retval true - every command in the batch succeeded
+ * @retval false - one or more commands failed
+ */
+boolean WiFly::endBatch(uint32_t *results)
+{
+    if (!batching) {
+        return false;
+    }
+
+    while (batchPending) {
+        batchCollect();
+    }
+    batching = false;
+    finishCommand();
+
+    if (results) {
+        *results = batchResults;
+    }
+
+    return !batchFailed;
+}
+
+/* Command engine states */
+#define CMD_IDLE       0
+#define CMD_GUARD      1    /* waiting for the line to be idle before $$$ */
+#define CMD_ESCAPE     2    /* waiting for CMD */
+#define CMD_SEND       3    /* in command mode, send the next command */
+#define CMD_REPLY      4    /* waiting for the ok or fail reply */
+#define CMD_CAPTURE    5    /* storing the rest of the ok reply line */
+#define CMD_SETTLE     6    /* discarding the rest of the reply */
+#define CMD_EXIT       7    /* waiting for EXIT */
+
+/* Time for the rest of a reply to arrive, see flushRx() */
+#define CMD_SETTLE_TIME 100
+
+static const char cmd_AOK[] PROGMEM = "AOK";
+static const char cmd_ERR[] PROGMEM = "ERR:";
+static const char cmd_CMD[] PROGMEM = "CMD\r\n";
+static const char cmd_EXIT[] PROGMEM = "EXIT\r\n";
+
+/**
+ * Set up a command for the non-blocking command engine, clearing the
+ * optional settings. Change ok, fail, buf or done before submitting
+ * the command if they are needed.
+ * @param command the command to send, without the \r
+ * @param argument appended to the command, or NULL
+ * @param msecs milliseconds to wait for the reply
+ */
+void WFCommand::begin(const __FlashStringHelper *command, const char *argument, uint16_t msecs)
+{
+    cmd = command;
+    arg = argument;
+    ok = NULL;
+    fail = NULL;
+    timeout = msecs;
+    buf = NULL;
+    size = 0;
+    done = NULL;
+    scan = NULL;
+    context = NULL;
+    status = WIFLY_CMD_IDLE;
+    next = NULL;
+}
+
+/**
+ * Queue a command for the non-blocking command engine. The command is
+ * run by poll(), which must be called regularly until the command's
+ * status shows it has finished or its done callback is called.
+ * Commands are run in the order they are submitted, in one command mode
+ * session. A blocking function called while commands are queued waits
+ * for them to finish first, so done callbacks may submit commands but
+ * must not call the blocking functions.
+ * @param cmd the command, see WFCommand::begin()
+ * @retval true - the command was queued
+ * @retval false - the command is already queued
+ */
+boolean WiFly::submit(WFCommand *cmd)
+{
+    if ((cmd->status == WIFLY_CMD_QUEUED) || (cmd->status == WIFLY_CMD_RUNNING)) {
+        return false;
+    }
+
+    cmd->status = WIFLY_CMD_QUEUED;
+    cmd->next = NULL;
+    if (cmdTail) {
+        cmdTail->next = cmd;
+    } else {
+        cmdHead = cmd;
+    }
+    cmdTail = cmd;
+    return true;
+}
+
+/**
+ * Set the final status of a command that is off the queue. A reply
+ * parser is told with a 0 character, so it can see the status.
+ */
+static void commandFinish(WFCommand *cmd, uint8_t status)
+{
+    cmd->next = NULL;
+    cmd->status = status;
+    if (cmd->scan) {
+        cmd->scan(cmd, '\0');
+    }
+    if (cmd->done) {
+        cmd->done(cmd, cmd->context);
+    }
+}
+
+/** Finish the running command and let the rest of its reply arrive */
+void WiFly::commandDone(uint8_t status)
+{
+    WFCommand *cmd = cmdHead;
+
+    cmdHead = cmd->next;
+    if (cmdHead == NULL) {
+        cmdTail = NULL;
+    }
+
+    cmdState = CMD_SETTLE;
+    cmdOk = 0;
+    cmdTime = clock->millis();
+
+    commandFinish(cmd, status);
+}
+
+/**
+ * Remove a command from the queue. If it is already running, the
+ * engine stops waiting for its reply, but the WiFly still finishes
+ * the command.
+ * @param cmd the command to remove
+ * @retval true - the command was removed, with status WIFLY_CMD_CANCELLED
+ * @retval false - the command was not queued
+ */
+boolean WiFly::cancel(WFCommand *cmd)
+{
+    WFCommand *prev = NULL;
+    WFCommand *ptr;
+
+    for (ptr=cmdHead; ptr && (ptr != cmd); ptr=ptr->next) {
+        prev = ptr;
+    }
+    if (ptr == NULL) {
+        return false;
+    }
+
+    if (cmd->status == WIFLY_CMD_RUNNING) {
+        commandDone(WIFLY_CMD_CANCELLED);
+        return true;
+    }
+
+    if (prev) {
+        prev->next = cmd->next;
+    } else {
+        cmdHead = cmd->next;
+    }
+    if (cmdTail == cmd) {
+        cmdTail = prev;
+    }
+    commandFinish(cmd, WIFLY_CMD_CANCELLED);
+    return true;
+}
+
+/**
+ * Run the non-blocking command engine. Enters command mode, sends the
+ * queued commands and matches their replies as far as the data that
+ * has already arrived allows, then returns without waiting. Command
+ * mode is left once the queue is empty. While the WiFly is asleep,
+ * queued commands fail with WIFLY_CMD_TIMEOUT.
+ * Data mode reads must not be mixed with queued commands, as the
+ * engine reads from the WiFly.
+ * @retval true - there is more to do, call poll() again
+ * @retval false - the engine is idle
+ */
+boolean WiFly::poll()
+{
+    WFCommand *cmd;
+    const char *str;
+    int data;
+
+    if (markerLen) {
+        markerRelease();
+    }
+
+    for (;;) {
+        cmd = cmdHead;
+        data = -1;
+
+        switch (cmdState) {
+        case CMD_IDLE:
+            if (cmd == NULL) {
+                return false;
+            }
+            if (asleep()) {
+                /* Fail rather than wait out the sleep, as startCommand() does */
+                commandDone(WIFLY_CMD_TIMEOUT);
+                cmdState = CMD_IDLE;
+                break;
+            }
+            cmdState = inCommandMode ? CMD_SEND : CMD_GUARD;
+            break;
+
+        case CMD_GUARD:
+            if (guardLeft()) {
+                return true;
+            }
+            send_P(F("$$$"));
+            txFlush();
+            cmdOk = 0;
+            cmdTime = clock->millis();
+            cmdState = CMD_ESCAPE;
+            break;
+
+        case CMD_ESCAPE:
+            while ((data = rxCount ? rxGet() : serial->read()) >= 0) {
+                cmdOk = matchStep(cmd_CMD, cmdOk, data);
+                if (pgm_read_byte(&cmd_CMD[cmdOk]) == '\0') {
+                    inCommandMode = true;
+                    modeKnown = true;
+                    cmdState = CMD_SEND;
+                    break;
+                }
+            }
+            if (cmdState == CMD_ESCAPE) {
+                if (clock->millis() - cmdTime < (uint32_t)guardTime + WIFLY_DEFAULT_TIMEOUT) {
+                    return true;
+                }
+                debug.println(F("Failed to enter command mode"));
+                modeKnown = false;
+                commandDone(WIFLY_CMD_TIMEOUT);
+                cmdState = CMD_IDLE;
+            }
+            break;
+
+        case CMD_SEND:
+            if ((cmd == NULL) && (exitCommand > 0)) {
+                /* Run from a blocking function, which will exit */
+                cmdState = CMD_IDLE;
+                break;
+            }
+            if (cmd == NULL) {
+                send_P(F("exit\r"));
+                txFlush();
+                cmdOk = 0;
+                cmdTime = clock->millis();
+                cmdState = CMD_EXIT;
+                break;
+            }
+            cmd->status = WIFLY_CMD_RUNNING;
+            send_P(cmd->cmd);
+            if (cmd->arg) {
+                send(cmd->arg);
+            }
+            send('\r');
+            txFlush();
+            cmdOk = 0;
+            cmdFail = 0;
+            cmdTime = clock->millis();
+            cmdState = CMD_REPLY;
+            break;
+
+        case CMD_REPLY:
+            while ((data = rxCount ? rxGet() : serial->read()) >= 0) {
+                if (cmd->scan) {
+                    uint8_t status = cmd->scan(cmd, data);
+                    if (status) {
+                        commandDone(status);
+                        break;
+                    }
+                    continue;
+                }
+                str = cmd->ok ? (const char *)cmd->ok : cmd_AOK;
+                cmdOk = matchStep(str, cmdOk, data);
+                if (pgm_read_byte(&str[cmdOk]) == '\0') {
+                    if (cmd->buf && cmd->size) {
+                        cmd->buf[0] = '\0';
+                        cmdLen = 0;
+                        cmdState = CMD_CAPTURE;
+                    } else {
+                        commandDone(WIFLY_CMD_OK);
+                    }
+                    break;
+                }
+                str = cmd->fail ? (const char *)cmd->fail : cmd_ERR;
+                cmdFail = matchStep(str, cmdFail, data);
+                if (pgm_read_byte(&str[cmdFail]) == '\0') {
+                    commandDone(WIFLY_CMD_FAILED);
+                    break;
+                }
+            }
+            if (cmdState == CMD_REPLY) {
+                if (clock->millis() - cmdTime < cmd->timeout) {
+                    return true;
+                }
+                commandDone(WIFLY_CMD_TIMEOUT);
+            }
+            break;
+
+        case CMD_CAPTURE:
+            while ((data = rxCount ? rxGet() : serial->read()) >= 0) {
+                if ((data == '\r') || (data == '\n')) {
+                    commandDone(WIFLY_CMD_OK);
+                    break;
+                }
+                if (cmdLen < (cmd->size - 1)) {
+                    cmd->buf[cmdLen++] = data;
+                    cmd->buf[cmdLen] = '\0';
+                }
+            }
+            if (cmdState == CMD_CAPTURE) {
+                if (clock->millis() - cmdTime < cmd->timeout) {
+                    return true;
+                }
+                commandDone(WIFLY_CMD_TIMEOUT);
+            }
+            break;
+
+        case CMD_SETTLE:
+            /* Done at the prompt, or once the WiFly goes quiet */
+            while ((data = rxCount ? rxGet() : serial->read()) >= 0) {
+                cmdTime = clock->millis();
+                if (!gotPrompt) {
+                    /* Not learnt yet, so take any "<x.xx> " as the prompt */
+                    if (data == '<') {
+                        cmdOk = 1;
+                    } else if (cmdOk == 1) {
+                        if (data == '>') {
+                            cmdOk = 2;
+                        } else if ((data != '.') && ((data < '0') || (data > '9'))) {
+                            cmdOk = 0;
+                        }
+                    } else if ((cmdOk == 2) && (data == ' ')) {
+                        cmdState = CMD_SEND;
+                        break;
+                    } else {
+                        cmdOk = 0;
+                    }
+                    continue;
+                }
+                if (data == prompt[cmdOk]) {
+                    cmdOk++;
+                } else {
+                    cmdOk = (data == prompt[0]);
+                }
+                if (prompt[cmdOk] == '\0') {
+                    cmdState = CMD_SEND;
+                    break;
+                }
+            }
+            if (cmdState == CMD_SETTLE) {
+                if (clock->millis() - cmdTime < CMD_SETTLE_TIME) {
+                    return true;
+                }
+                cmdState = CMD_SEND;
+            }
+            break;
+
+        case CMD_EXIT:
+            while ((data = rxCount ? rxGet() : serial->read()) >= 0) {
+                cmdOk = matchStep(cmd_EXIT, cmdOk, data);
+                if (pgm_read_byte(&cmd_EXIT[cmdOk]) == '\0') {
+                    inCommandMode = false;
+                    cmdState = CMD_IDLE;
+                    break;
+                }
+            }
+            if (cmdState == CMD_EXIT) {
+                if (clock->millis() - cmdTime < WIFLY_DEFAULT_TIMEOUT) {
+                    return true;
+                }
+                debug.println(F("Failed to exit\r\n"));
+                modeKnown = false;
+                cmdState = CMD_IDLE;
+            }
+            break;
+        }
+    }
+}
+
+/* Join progress reported by the WiFly */
+static const char joinTokens[][12] PROGMEM = {
+    "Joining ",
+    "Associated!",
+    "DHCP",
+    "GW=",
+    "AUTH-ERR",
+    "FAILED",
+    "ERR:",
+};
+
+#define JOIN_JOINING    0
+#define JOIN_ASSOCIATED 1
+#define JOIN_DHCP       2
+#define JOIN_BOUND      3
+#define JOIN_AUTH_ERR   4
+#define JOIN_FAILED     5
+#define JOIN_ERR        6
+
+/** Move a join to a new phase, recording when it got there */
+static void joinPhase(WFJoin *join, uint8_t phase, uint8_t reason)
+{
+    uint32_t elapsed = join->clock->millis() - join->started;
+
+    join->phase = phase;
+    join->reason = reason;
+    join->at[phase] = elapsed > 0xffff ? 0xffff : elapsed;
+    if (join->progress) {
+        join->progress(join, join->cmd.context);
+    }
+}
+
+/**
+ * Reply parser for joinAsync(). Follows the join through the messages
+ * the WiFly prints, and finishes the command when it has an address or
+ * has failed.
+ */
+static uint8_t joinScan(WFCommand *cmd, char ch)
+{
+    WFJoin *join = (WFJoin *)cmd;
+    int8_t found = -1;
+
+    if (ch == '\0') {
+        /* Finished by the engine, without DHCP a join succeeds once associated */
+        if ((cmd->status != WIFLY_CMD_OK) && (join->phase < WIFLY_JOIN_BOUND)) {
+            joinPhase(join, WIFLY_JOIN_FAILED,
+                cmd->status == WIFLY_CMD_CANCELLED ? WIFLY_JOIN_CANCELLED : WIFLY_JOIN_TIMEOUT);
+        }
+        return 0;
+    }
+
+    for (uint8_t ind=0; ind < (sizeof(joinTokens)/sizeof(joinTokens[0])); ind++) {
+        join->matched[ind] = matchStep(joinTokens[ind], join->matched[ind], ch);
+        if (pgm_read_byte(&joinTokens[ind][join->matched[ind]]) == '\0') {
+            join->matched[ind] = 0;
+            found = ind;
+        }
+    }
+
+    switch (found) {
+    case JOIN_JOINING:
+        if (join->phase == WIFLY_JOIN_SCANNING) {
+            joinPhase(join, WIFLY_JOIN_JOINING, WIFLY_JOIN_OK);
+        }
+        break;
+    case JOIN_ASSOCIATED:
+        joinPhase(join, WIFLY_JOIN_ASSOCIATED, WIFLY_JOIN_OK);
+        if (!join->dhcp) {
+            return WIFLY_CMD_OK;
+        }
+        break;
+    case JOIN_DHCP:
+        if (join->phase == WIFLY_JOIN_ASSOCIATED) {
+            joinPhase(join, WIFLY_JOIN_DHCP, WIFLY_JOIN_OK);
+        }
+        break;
+    case JOIN_BOUND:
+        joinPhase(join, WIFLY_JOIN_BOUND, WIFLY_JOIN_OK);
+        return WIFLY_CMD_OK;
+    case JOIN_AUTH_ERR:
+        joinPhase(join, WIFLY_JOIN_FAILED, WIFLY_JOIN_AUTH);
+        return WIFLY_CMD_FAILED;
+    case JOIN_FAILED:
+    case JOIN_ERR:
+        if (join->phase >= WIFLY_JOIN_ASSOCIATED) {
+            joinPhase(join, WIFLY_JOIN_FAILED, WIFLY_JOIN_NO_LEASE);
+        } else if (join->phase == WIFLY_JOIN_JOINING) {
+            joinPhase(join, WIFLY_JOIN_FAILED, WIFLY_JOIN_AUTH);
+        } else {
+            joinPhase(join, WIFLY_JOIN_FAILED, WIFLY_JOIN_NOT_FOUND);
+        }
+        return WIFLY_CMD_FAILED;
+    }
+    return 0;
+}
+
+/**
+ * Start joining a wireless network without waiting for the result.
+ * Call poll() until the join's phase is WIFLY_JOIN_BOUND or
+ * WIFLY_JOIN_FAILED; join->at[] has the time taken to reach each phase.
+ * With DHCP disabled the join finishes once associated. Cancel with
+ * cancel(&join->cmd); the WiFly may still go on to associate.
+ * @param join the join to start. progress, cmd.done and cmd.context may
+ *             be set after this call.
+ * @param ssid the SSID to join, or NULL for the stored SSID
+ * @param timeout milliseconds to wait for the join to finish
+ * @retval true - the join was queued
+ */
+boolean WiFly::joinAsync(WFJoin *join, const char *ssid, uint16_t timeout)
+{
+    /* The IP settings change when DHCP completes */
+    invalidateConfig();
+    statusValid = false;
+
+    join->cmd.begin(F("join "), ssid, timeout);
+    join->cmd.scan = joinScan;
+    join->dhcp = dhcp;
+    join->clock = clock;
+    join->started = clock->millis();
+    join->progress = NULL;
+    memset(join->at, 0, sizeof(join->at));
+    memset(join->matched, 0, sizeof(join->matched));
+    join->phase = WIFLY_JOIN_SCANNING;
+    join->reason = WIFLY_JOIN_OK;
+
+    return submit(&join->cmd);
+}
+
+/**
+ * Start a DNS lookup without waiting for the result.
+ * @param cmd the command to use
+ * @param hostname the host to look up
+ * @param buf buffer for the IP address, must stay in scope until the
+ *            command finishes
+ * @param size size of buf
+ * @retval true - the lookup was queued
+ */
+boolean WiFly::lookupAsync(WFCommand *cmd, const char *hostname, char *buf, int size)
+{
+    cmd->begin(F("lookup "), hostname, 5000);
+    cmd->ok = F("=");
+    cmd->fail = F("failed");
+    cmd->buf = buf;
+    cmd->size = size > 255 ? 255 : size;
+    return submit(cmd);
+}
+
+/**
+ * Start a ping without waiting for the result. Unlike ping(), no DNS
+ * lookup is done; use lookupAsync() first for a host name.
+ * @param cmd the command to use
+ * @param addr the IP address to ping
+ * @retval true - the ping was queued
+ */
+boolean WiFly::pingAsync(WFCommand *cmd, const char *addr)
+{
+    cmd->begin(F("ping "), addr, 5000);
+    cmd->ok = F("reply from");
+    return submit(cmd);
 }
 
 /* Save current configuration */
@@ -1770,7 +3543,8 @@ boolean WiFly::save()
     return res;
 }
 
-/** Reboots the WiFly.
+/** Reboots the WiFly, returning as soon as it reports that it
+ * is ready. getBootTime() gives the time the reboot took.
  * @note Depending on the shield, this may also reboot the Arduino.
  */
 boolean WiFly::reboot()
@@ -1778,20 +3552,118 @@ boolean WiFly::reboot()
     if (!startCommand()) {
         return false;
     }
+    invalidateConfig();
+    udpDest = NULL;
     send_P(F("reboot\r"));
     if (!match_P(F("*Reboot*"))) {
         finishCommand();
         return false;
     }
 
-    delay(5000);
     inCommandMode = false;
     exitCommand = 0;
+    sleeping = true;
+    statusValid = false;
+    readyLen = 0;
+    sleepStart = clock->millis();
+    wakeTime = 0;
+
+    /* Carry on as soon as the WiFly has booted */
+    if (!waitReady(WIFLY_BOOT_TIMEOUT)) {
+        debug.println(F("reboot: no *READY*"));
+    }
     init();
     return true;
 
 }
 
+static const char readyMarker[] PROGMEM = "*READY*";
+
+/**
+ * Check whether the WiFly has finished waking from sleep(), or booting
+ * after reboot(), by watching for the *READY* it sends. Doesn't block,
+ * so it can be polled while the sketch does other work. Once it returns
+ * true, getBootTime() gives the time taken after the wake timer expired.
+ * @retval true - the WiFly is awake
+ * @retval false - still waiting for *READY*
+ */
+boolean WiFly::wakeComplete()
+{
+    char ch;
+
+    if (!sleeping) {
+        return true;
+    }
+
+    while ((rxCount || (serial->available() > 0)) && readTimeout(&ch, 0)) {
+        readyLen = matchStep(readyMarker, readyLen, ch);
+        if (pgm_read_byte(&readyMarker[readyLen]) == '\0') {
+            awake(true);
+            DPRINT(F("ready after ")); DPRINT(bootTime); DPRINT(F(" ms\r\n"));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Check whether the WiFly is still asleep or booting, without waiting.
+ * If *READY* is overdue (wake timer plus WIFLY_BOOT_TIMEOUT), it was
+ * missed or never comes, so the WiFly is taken to be awake.
+ * @retval true - commands sent now would be lost
+ */
+boolean WiFly::asleep()
+{
+    if (!sleeping || wakeComplete()) {
+        return false;
+    }
+    if (clock->millis() - sleepStart < wakeTime + WIFLY_BOOT_TIMEOUT) {
+        return true;
+    }
+    awake(false);
+    return false;
+}
+
+/**
+ * Record that the WiFly has woken or finished booting. The boot time
+ * leaves out the sleep itself.
+ * @param ready true if *READY* was seen, so the WiFly is in data mode
+ */
+void WiFly::awake(boolean ready)
+{
+    uint32_t elapsed = clock->millis() - sleepStart;
+
+    sleeping = false;
+    bootTime = elapsed > wakeTime ? elapsed - wakeTime : 0;
+    if (ready) {
+        /* It comes up in data mode */
+        inCommandMode = false;
+    }
+    modeKnown = ready;
+}
+
+/**
+ * Wait for the WiFly to wake or finish booting, see wakeComplete().
+ * @param timeout milliseconds to wait for *READY*, after which the
+ *        WiFly is assumed to be ready
+ * @retval true - *READY* seen
+ * @retval false - timed out
+ */
+boolean WiFly::waitReady(uint32_t timeout)
+{
+    uint32_t start = clock->millis();
+
+    while (!wakeComplete()) {
+        if (clock->millis() - start >= timeout) {
+            awake(false);
+            return false;
+        }
+        clock->idle();
+    }
+    return true;
+}
+
 /** Restore factory default settings */
 boolean WiFly::factoryRestore()
 {
@@ -1800,6 +3672,13 @@ boolean WiFly::factoryRestore()
     if (!startCommand()) {
         return false;
     }
+    invalidateConfig();
+    udpDest = NULL;
+    passHash = 0;
+    if (fingerprintStore) {
+        /* the setup begin() saved is gone */
+        fingerprintStore(true, 0);
+    }
     send_P(F("factory RESTORE\r"));
     if (match_P(F("Set Factory Defaults"))) {
         getPrompt();
@@ -1857,16 +3736,19 @@ boolean WiFly::setPort(const uint16_t port)
 
 boolean WiFly::setHostIP(const __FlashStringHelper *buf)
 {
+    udpDest = NULL;
     return setopt(F("set ip host"), NULL, buf);
 }
 
 boolean WiFly::setHostIP(const char *buf)
 {
+    udpDest = NULL;
     return setopt(F("set ip host"), buf);
 }
 
 boolean WiFly::setHostPort(const uint16_t port)
 {
+    udpDest = NULL;
     return setopt(F("set ip remote"), port);
 }
 
@@ -1918,7 +3800,11 @@ boolean WiFly::setDHCP(const uint8_t mode)
     buf[0] = '0' + mode;
     buf[1] = 0;
 
-    return setopt(F("set ip dhcp"), buf);
+    if (!setopt(F("set ip dhcp"), buf)) {
+        return false;
+    }
+    dhcp = !((mode == WIFLY_DHCP_MODE_OFF) || (mode == WIFLY_DHCP_MODE_SERVER));
+    return true;
 }
 
 boolean WiFly::setProtocol(const uint8_t protocol)
@@ -2011,7 +3897,12 @@ boolean WiFly::disableUdpAutoPair()
  */
 boolean WiFly::setFlushTimeout(const uint16_t timeout)
 {
-    return setopt(F("set comm time"), timeout);
+    if (!setopt(F("set comm time"), timeout)) {
+        return false;
+    }
+    /* Data may be held this long, keep $$$ clear of it */
+    flushTime = timeout;
+    return true;
 }
 
 /** Set the comms flush character. 0 disables the feature.
@@ -2036,7 +3927,13 @@ boolean WiFly::setFlushSize(uint16_t size)
         size = 1460;
     }
 
-    return setopt(F("set comm size"), size);
+    if (!setopt(F("set comm size"), size)) {
+        return false;
+    }
+
+    /* Don't stage more than the WiFly sends in a packet */
+    txThreshold = (size > 0) && (size < WIFLY_TX_BUFFER_SIZE) ? size : WIFLY_TX_BUFFER_SIZE;
+    return true;
 }
 
 /** Set the WiFly IO function option */
@@ -2059,26 +3956,32 @@ boolean WiFly::setIOFunc(const uint8_t func)
  */
 boolean WiFly::enableDataTrigger(const uint16_t flushTimeout, const char flushChar, const uint16_t flushSize)
 {
-    bool res=true;
+    uint8_t mode = getUartMode();
 
-    res = res && setUartMode(getUartMode() | WIFLY_UART_MODE_DATA_TRIGGER);
-    res = res && setFlushTimeout(flushTimeout);
-    res = res && setFlushChar(flushChar);
-    res = res && setFlushSize(flushSize);
+    if (!beginBatch()) {
+        return false;
+    }
+    setUartMode(mode | WIFLY_UART_MODE_DATA_TRIGGER);
+    setFlushTimeout(flushTimeout);
+    setFlushChar(flushChar);
+    setFlushSize(flushSize);
 
-    return res;
+    return endBatch();
 }
 
 boolean WiFly::disableDataTrigger()
 {
-    bool res=true;
+    uint8_t mode = getUartMode();
 
-    res = res && setUartMode(getUartMode() & ~WIFLY_UART_MODE_DATA_TRIGGER);
-    res = res && setFlushTimeout(10);
-    res = res && setFlushChar(0);
-    res = res && setFlushSize(64);
+    if (!beginBatch()) {
+        return false;
+    }
+    setUartMode(mode & ~WIFLY_UART_MODE_DATA_TRIGGER);
+    setFlushTimeout(10);
+    setFlushChar(0);
+    setFlushSize(64);
 
-    return res;
+    return endBatch();
 }
 
 /** Hide passphrase and key */
@@ -2114,12 +4017,56 @@ boolean WiFly::setChannel(uint8_t channel)
     return setopt(F("set wlan chan"), channel);
 }
 
+/** Get the configured WiFi channel, 0 if the WiFly scans for the network */
+uint8_t WiFly::getChannel()
+{
+    return getopt(WIFLY_GET_CHANNEL);
+}
+
 /** Set auth mode, normally leave as 0, but wep64 requires 8 */
 boolean WiFly::setAuth(uint8_t mode)
 {
     return setopt(F("set wlan auth"), mode);
 }
 
+const static struct {
+    uint8_t mode;
+    char name[7];
+} authmap[] __attribute__((__progmem__)) = {
+    { WIFLY_AUTH_OPEN,     "OPEN" },
+    { WIFLY_AUTH_WEP64,    "WEP-64" },
+    { WIFLY_AUTH_WEP128,   "WEP" },
+    { WIFLY_AUTH_WPA1,     "WPA1" },
+    { WIFLY_AUTH_MIXED,    "MIXED" },
+    { WIFLY_AUTH_WPA2_PSK, "WPA2" },
+    { WIFLY_AUTH_ADHOC,    "ADHOC" }
+};
+
+/**
+ * Get the WiFi authentication mode. The WiFly reports the mode by name,
+ * e.g. "WPA2-PSK", which is mapped to the number setAuth() takes.
+ * @returns the mode, or 0xff if it can't be read or isn't known
+ */
+uint8_t WiFly::getAuth()
+{
+    char buf[16];
+
+    if (!getopt(WIFLY_GET_AUTH, buf, sizeof(buf))) {
+        return 0xff;
+    }
+
+    if ((buf[0] >= '0') && (buf[0] <= '9')) {
+        return atou(buf);
+    }
+    for (uint8_t ind=0; ind < (sizeof(authmap)/sizeof(authmap[0])); ind++) {
+        if (strncmp_P(buf, authmap[ind].name, strlen_P(authmap[ind].name)) == 0) {
+            return pgm_read_byte(&authmap[ind].mode);
+        }
+    }
+
+    return 0xff;    // unknown
+}
+
 /** Set WEP key */
 boolean WiFly::setKey(const char *buf)
 {
@@ -2148,6 +4095,7 @@ boolean WiFly::setPassphrase(const char *buf)
 {
     boolean res;
     res = setopt(F("set wlan phrase"), buf, NULL, true);
+    passHash = res ? passphraseHash(buf) : 0;
 
     hide();    /* hide the key */
     return res;
@@ -2298,41 +4246,41 @@ uint16_t WiFly::getAdhocReboot()
     return getopt(WIFLY_GET_REBOOT);
 }
 
-/** join a wireless network */
+/**
+ * Join a wireless network, waiting for the result. Runs joinAsync(), so
+ * a failure is seen as soon as the WiFly reports it.
+ * @param ssid the SSID to join, or NULL for the stored SSID
+ * @param timeout milliseconds to wait for association, DHCP gets 15
+ *                seconds more
+ * @retval true - joined
+ * @retval false - failed to join, or timed out
+ */
 boolean WiFly::join(const char *ssid, uint16_t timeout)
 {
-    int8_t res;
-    const char *joinResult[] PROGMEM = {
-        "FAILED",
-        "Associated!"
-    };
+    WFJoin join;
+    uint32_t limit = timeout;
 
     if (!startCommand()) {
         return false;
     }
 
-    send_P(F("join "));
-    if (ssid != NULL) {
-        send(ssid);
+    /* Allow for DHCP on top of the association */
+    if (dhcp) {
+        limit += 15000;
     }
-    send_P(F("\r"));
-
-    res = multiMatch_P(joinResult,2,timeout);
-    flushRx(100);
-    if (res == 1) {
-        status.assoc = 1;
-        if (dhcp) {
-            // need some time to complete DHCP request
-            match_P(F("GW="), 15000);
-            flushRx(100);
-        }
-        gets(NULL,0);
-        finishCommand();
-        return true;
+    joinAsync(&join, ssid, limit > 0xffff ? 0xffff : limit);
+    while (poll()) {
+        clock->idle();
     }
 
     finishCommand();
-    return false;
+
+    if (join.phase == WIFLY_JOIN_FAILED) {
+        statusValid = false;
+        return false;
+    }
+    status.assoc = 1;
+    return true;
 }
 
 /** join a wireless network */
@@ -2355,6 +4303,7 @@ boolean WiFly::join(uint16_t timeout)
  */
 boolean WiFly::join(const char *ssid, const char *password, bool dhcp, uint8_t mode, uint16_t timeout)
 {
+    beginBatch();
     setSSID(ssid);
     if (mode == WIFLY_MODE_WPA) {
         setPassphrase(password);
@@ -2369,13 +4318,97 @@ boolean WiFly::join(const char *ssid, const char *password, bool dhcp, uint8_t m
     if (dhcp) {
         enableDHCP();
     }
+    endBatch();
 
     return join(ssid, timeout);
 }
 
+/**
+ * Record the current association so that reconnect() can skip the
+ * channel scan and reuse the DHCP lease.
+ * @param link where to record the association
+ * @retval true - associated, link recorded
+ * @retval false - not associated, link marked invalid
+ */
+boolean WiFly::saveLink(WFLink *link)
+{
+    link->valid = false;
+
+    if (!startCommand()) {
+        return false;
+    }
+
+    getConnection();
+    if ((status.assoc == 1) && (status.channel != 0)) {
+        link->channel = status.channel;
+        link->dhcpMode = getDHCPMode();
+        getIP(link->ip, sizeof(link->ip));
+        link->valid = true;
+    }
+
+    finishCommand();
+    return link->valid;
+}
+
+/**
+ * Rejoin the network after the WiFly has lost it. With a valid link,
+ * the join is pinned to the saved channel and DHCP uses the cached
+ * lease, so neither a scan nor a DHCP exchange is needed. If that
+ * fails, a full join is done and the link is saved again.
+ * Afterwards the DHCP mode and the configured channel are put back,
+ * so that a later join() scans as before.
+ * @param link the link saved by saveLink()
+ * @param timeout milliseconds to wait for each join
+ * @retval true - joined
+ * @retval false - failed to join
+ */
+boolean WiFly::reconnect(WFLink *link, uint16_t timeout)
+{
+    boolean cache;
+    boolean res = false;
+
+    if (!startCommand()) {
+        return false;
+    }
+
+    if (link->valid) {
+        uint8_t channel = getChannel();
+
+        cache = (link->dhcpMode == WIFLY_DHCP_MODE_ON);
+
+        beginBatch();
+        setChannel(link->channel);
+        if (cache) {
+            setDHCP(WIFLY_DHCP_MODE_CACHE);
+        }
+        if (endBatch()) {
+            res = join(NULL, timeout);
+        }
+
+        beginBatch();
+        setChannel(channel);
+        if (cache) {
+            setDHCP(link->dhcpMode);
+        }
+        endBatch();
+    }
+
+    if (!res) {
+        DPRINTLN(F("reconnect: full join"));
+        res = join(NULL, timeout);
+        if (res) {
+            saveLink(link);
+        }
+    }
+
+    finishCommand();
+    return res;
+}
+
 /** leave the wireless network */
 boolean WiFly::leave()
 {
+    invalidateConfig();
     send_P(F("leave\r"));
 
     /* Don't care about result, it either succeeds with a
@@ -2389,10 +4422,17 @@ boolean WiFly::leave()
     return true;
 }
 
-/** Check to see if the WiFly is connected to a wireless network */
+/**
+ * Check to see if the WiFly is connected to a wireless network.
+ * The status is only read from the WiFly once it is older than the
+ * status TTL, see setStatusTTL(). In between, join(), leave() and the
+ * *OPEN* and *CLOS* markers keep it up to date.
+ */
 boolean WiFly::isAssociated()
 {
-    getConnection();
+    if (!statusValid || ((clock->millis() - statusTime) >= statusTTL)) {
+        getConnection();
+    }
     return (status.assoc == 1);
 }
 
@@ -2416,7 +4456,10 @@ boolean WiFly::isDotQuad(const char *addr)
 {
     uint32_t value;
 
-    for (uint8_t ind=0; ind<3; ind++) {
+    for (uint8_t ind=0; ind<4; ind++) {
+        if ((*addr < '0') || (*addr > '9')) {
+            return false;
+        }
         value  = atou(addr);
         if (value > 255) {
             return false;
@@ -2431,6 +4474,7 @@ boolean WiFly::isDotQuad(const char *addr)
         if (*addr != '.') {
             return false;
         }
+        addr++;
     }
 
     return false;
@@ -2440,8 +4484,8 @@ boolean WiFly::isDotQuad(const char *addr)
 /** Send final chunk, end of HTTP message */
 void WiFly::sendChunkln()
 {
-    serial->println('0');
-    serial->println();
+    println('0');
+    println();
 }
 
 /**
@@ -2452,9 +4496,9 @@ void WiFly::sendChunkln()
  */
 void WiFly::sendChunkln(const char *str)
 {
-    serial->println(strlen(str)+2,HEX);
-    serial->println(str);
-    serial->println();
+    println(strlen(str)+2,HEX);
+    println(str);
+    println();
 }
 
 /**
@@ -2465,9 +4509,9 @@ void WiFly::sendChunkln(const char *str)
  */
 void WiFly::sendChunkln(const __FlashStringHelper *str)
 {
-    serial->println(strlen_P((const char *)str)+2,HEX);
-    serial->println(str);
-    serial->println();
+    println(strlen_P((const char *)str)+2,HEX);
+    println(str);
+    println();
 }
 
 /**
@@ -2478,8 +4522,8 @@ void WiFly::sendChunkln(const __FlashStringHelper *str)
  */
 void WiFly::sendChunk(const char *str)
 {
-    serial->println(strlen(str),HEX);
-    serial->println(str);
+    println(strlen(str),HEX);
+    println(str);
 }
 
 /**
@@ -2490,8 +4534,8 @@ void WiFly::sendChunk(const char *str)
  */
 void WiFly::sendChunk(const __FlashStringHelper *str)
 {
-    serial->println(strlen_P((const char *)str),HEX);
-    serial->println(str);
+    println(strlen_P((const char *)str),HEX);
+    println(str);
 }
 
 /**
@@ -2549,6 +4593,7 @@ boolean WiFly::ping(const char *host)
 boolean WiFly::createAdhocNetwork(const char *ssid, uint8_t channel)
 {
     startCommand();
+    beginBatch();
     setDHCP(WIFLY_DHCP_MODE_OFF);
     setIP(F("169.254.1.1"));
     setNetmask(F("255.255.0.0"));
@@ -2556,6 +4601,7 @@ boolean WiFly::createAdhocNetwork(const char *ssid, uint8_t channel)
     setJoin(WIFLY_WLAN_JOIN_ADHOC);
     setSSID(ssid);
     setChannel(channel);
+    endBatch();
     save();
     finishCommand();
     reboot();
@@ -2577,6 +4623,9 @@ boolean WiFly::createAdhocNetwork(const char *ssid, uint8_t channel)
 boolean WiFly::open(const char *addr, uint16_t port, boolean block, uint16_t timeout)
 {
     char buf[20];
+#if WIFLY_DNS_CACHE_SIZE > 0
+    char ip[16];
+#endif
     char ch;
 
     if (connecting) {
@@ -2586,11 +4635,27 @@ boolean WiFly::open(const char *addr, uint16_t port, boolean block, uint16_t tim
 
     startCommand();
 
+#if WIFLY_DNS_CACHE_SIZE > 0
+    /* Resolve host names here, so the address can come from the DNS cache */
+    if (!isDotQuad(addr)) {
+        if (!getHostByName(addr, ip, sizeof(ip))) {
+            debug.print(F("Failed to resolve ")); debug.println(addr);
+            finishCommand();
+            return false;
+        }
+        addr = ip;
+    }
+#endif
+
     /* Already connected? Close the connection first */
     if (connected) {
         close();
     }
 
+    /* Forget any close from the previous connection */
+    closed = false;
+    markerLen = 0;
+
     simple_utoa(port, 10, buf, sizeof(buf));
     debug.print(F("open ")); debug.print(addr); debug.print(' '); debug.println(buf);
     send_P(F("open "));
@@ -2620,8 +4685,11 @@ boolean WiFly::open(const char *addr, uint16_t port, boolean block, uint16_t tim
             if (match_P(F("OPEN*"))) {
                 DPRINT(F("Connected\r\n"));
                 connected = true;
+                status.tcp = WIFLY_TCP_CONNECTED;
+                status.assoc = 1;
                 /* successful connection exits command mode */
                 inCommandMode = false;
+                exitCommand--;
                 return true;
             } else {
                 finishCommand();
@@ -2689,6 +4757,238 @@ boolean WiFly::isInCommandMode()
     return inCommandMode;
 }
 
+/**
+ * Set up a UDP destination for udpSend(). A host name is resolved now.
+ * @param session the session to set up
+ * @param host the IP address or host name to send to
+ * @param port the UDP port to send to
+ * @retval true - ready to send
+ * @retval false - failed to resolve host
+ */
+boolean WiFly::udpBegin(WFUdpSession *session, const char *host, uint16_t port)
+{
+    if (udpDest == session) {
+        udpDest = NULL;
+    }
+
+    if (isDotQuad(host)) {
+        strncpy(session->host, host, sizeof(session->host));
+        session->host[sizeof(session->host)-1] = '\0';
+    } else if (!getHostByName(host, session->host, sizeof(session->host))) {
+        debug.print(F("udpBegin: failed to resolve ")); debug.println(host);
+        return false;
+    }
+
+    session->port = port;
+    session->packets = 0;
+    session->bytes = 0;
+    session->switches = 0;
+    session->started = clock->millis();
+    return true;
+}
+
+/**
+ * Point the WiFly at a session's destination. The remote host and port
+ * are only set, as one batch, when it was last pointed at a different
+ * destination, and they are left set afterwards. With UDP auto pairing
+ * the WiFly changes its host itself, so it is set every time.
+ * @param session the destination
+ * @retval true - the WiFly is sending to the destination
+ */
+boolean WiFly::udpSelect(WFUdpSession *session)
+{
+    boolean res;
+
+    if ((udpDest == session) && !udpAutoPair) {
+        return true;
+    }
+
+    if (!startCommand()) {
+        debug.println(F("udpSend: failed to start command"));
+        return false;
+    }
+    beginBatch();
+    setHostIP(session->host);
+    setHostPort(session->port);
+    res = endBatch();
+    finishCommand();
+
+    if (res) {
+        udpDest = session;
+        session->switches++;
+    }
+    return res;
+}
+
+/**
+ * Send a UDP packet to a session's destination. The WiFly's remote
+ * host is only changed if it was last used for another destination.
+ * @param session the destination, see udpBegin()
+ * @param data the packet
+ * @param size the size of the packet
+ * @retval true - packet sent
+ * @retval false - failed to set the destination
+ */
+boolean WiFly::udpSend(WFUdpSession *session, const uint8_t *data, uint16_t size)
+{
+    if (!udpSelect(session)) {
+        return false;
+    }
+
+    write(data, size);
+    session->packets++;
+    session->bytes += size;
+    return true;
+}
+
+/**
+ * Send a string as a UDP packet to a session's destination.
+ * @param session the destination, see udpBegin()
+ * @param data the string to send
+ * @retval true - packet sent
+ * @retval false - failed to set the destination
+ */
+boolean WiFly::udpSend(WFUdpSession *session, const char *data)
+{
+    return udpSend(session, (const uint8_t *)data, strlen(data));
+}
+
+/**
+ * Send a UDP packet made of several pieces to a session's destination,
+ * see writev().
+ * @param session the destination, see udpBegin()
+ * @param segs the pieces of the packet, in order
+ * @param count the number of pieces
+ * @retval true - packet sent
+ * @retval false - failed to set the destination
+ */
+boolean WiFly::udpSend(WFUdpSession *session, const WFSegment *segs, uint8_t count)
+{
+    if (!udpSelect(session)) {
+        return false;
+    }
+
+    session->bytes += writev(segs, count);
+    session->packets++;
+    return true;
+}
+
+/**
+ * Packets per second sent to a session's destination since udpBegin().
+ * @param session the destination
+ * @returns packets per second
+ */
+uint32_t WiFly::udpRate(WFUdpSession *session)
+{
+    uint32_t elapsed = clock->millis() - session->started;
+
+    return elapsed ? (session->packets * 1000UL) / elapsed : 0;
+}
+
+/**
+ * Start writing framed messages. The WiFly's flush size, match
+ * character and flush timer are read once and kept in the frame, so
+ * that frameWrite() can tell where the WiFly will end each packet.
+ * @param frame the framed writer state
+ * @param mode WIFLY_FRAME_SPLIT to end a packet early by letting the
+ *             flush timer run out, or WIFLY_FRAME_PAD to end it by
+ *             padding it out to the flush size.
+ * @param pad the padding byte for WIFLY_FRAME_PAD, must not be the
+ *            match character
+ * @retval true - ready to write
+ * @retval false - failed to read the settings
+ */
+boolean WiFly::frameBegin(WFFrame *frame, uint8_t mode, char pad)
+{
+    if (!startCommand()) {
+        debug.println(F("frameBegin: failed to start command"));
+        return false;
+    }
+    frame->size = getFlushSize();
+    frame->match = getFlushChar();
+    frame->timer = getFlushTimeout();
+    finishCommand();
+
+    frame->mode = mode;
+    frame->pad = pad;
+    frame->fill = 0;
+    frame->messages = 0;
+    frame->crossed = 0;
+    frame->padding = 0;
+    return true;
+}
+
+/**
+ * Write a message so that it starts a packet if it doesn't fit in
+ * what is left of the current one. Messages that do fit are packed
+ * into the same packet, so small messages don't each make a packet.
+ * A message larger than the flush size, or containing the match
+ * character before its end, still crosses a packet boundary and is
+ * counted in the frame's crossed count.
+ * All data mode writes should go through frameWrite() between
+ * frameBegin() and the end of framing.
+ * In WIFLY_FRAME_SPLIT mode frameWrite() doesn't wait for the flush
+ * timer to end the packet. It writes nothing and returns 0 until the
+ * timer has run out, so call it again later with the same message.
+ * @param frame the framed writer state, see frameBegin()
+ * @param data the message
+ * @param size the size of the message
+ * @returns the number of bytes of the message written, 0 if it has to
+ *          wait for the flush timer
+ */
+size_t WiFly::frameWrite(WFFrame *frame, const uint8_t *data, uint16_t size)
+{
+    boolean buffering = txBuffering;
+    boolean split = false;
+    uint32_t idle;
+    uint16_t left;
+
+    txFlush();
+    idle = clock->millis() - lastTx;
+
+    /* The WiFly has sent what it held if the flush timer ran out */
+    if (frame->fill && frame->timer && (idle > frame->timer)) {
+        frame->fill = 0;
+    }
+
+    if (frame->fill && frame->size && ((frame->fill + size) > frame->size)) {
+        /* End the packet here rather than part way through the message */
+        if ((frame->mode == WIFLY_FRAME_SPLIT) && frame->timer) {
+            /* The flush timer hasn't run out yet, come back later */
+            return 0;
+        }
+        txBuffering = true;
+        left = frame->size - frame->fill;
+        frame->padding += left;
+        while (left--) {
+            write((uint8_t)frame->pad);
+        }
+        frame->fill = 0;
+    }
+    txBuffering = true;
+    write(data, size);
+    txBuffering = buffering;
+    txFlush();
+
+    /* Follow where the WiFly ends packets within the message */
+    for (uint16_t pos=0; pos < size; pos++) {
+        frame->fill++;
+        if ((frame->match && (data[pos] == (uint8_t)frame->match)) ||
+            (frame->size && (frame->fill >= frame->size))) {
+            if (pos < (size - 1)) {
+                split = true;
+            }
+            frame->fill = 0;
+        }
+    }
+
+    frame->messages++;
+    if (split) {
+        frame->crossed++;
+    }
+    return size;
+}
+
 /** Internal UPD sendto function */
 boolean WiFly::sendto(
     const uint8_t *data,
@@ -2698,13 +4998,25 @@ boolean WiFly::sendto(
     uint16_t port)
 {
     bool restore = true;
+    char ip[16];
 
     if (!startCommand()) {
         debug.println(F("sendto: failed to start command"));
         return false;
     }
 
-    if (udpAutoPair || (port != lastPort) || (strcmp(host, lastHost) != 0)) {
+    /* The WiFly's host setting needs an address */
+    if (!isDotQuad(host)) {
+        if (!getHostByName(host, ip, sizeof(ip))) {
+            debug.print(F("sendto: failed to resolve ")); debug.println(host);
+            finishCommand();
+            return false;
+        }
+        host = ip;
+    }
+
+    /* A UDP session may have changed the host since lastHost was set */
+    if (udpAutoPair || udpDest || (port != lastPort) || (strcmp(host, lastHost) != 0)) {
         setHost(host,port);
         if (!restoreHost) {
             /* Keep a copy of this for reference for the next call */
@@ -2730,7 +5042,14 @@ boolean WiFly::sendto(
     if (data) {
         write(data, size);
     } else if (flashData) {
+        /* Stage the string so the datagram goes out in blocks */
+        bool buffering = txBuffering;
+        txBuffering = true;
         print(flashData);
+        txBuffering = buffering;
+        if (!txBuffering) {
+            txFlush();
+        }
     }
 
     /* Restore original host and port */
@@ -2889,8 +5208,11 @@ boolean WiFly::openComplete()
                 DPRINT(F("Connected\r\n"));
                 connected = true;
                 connecting = false;
+                status.tcp = WIFLY_TCP_CONNECTED;
+                status.assoc = 1;
                 /* successful connection exits command mode */
                 inCommandMode = false;
+                exitCommand--;
                 DPRINT(F("openComplete: true\r\n"));
                 return true;
             } else {
@@ -2959,9 +5281,9 @@ boolean WiFly::close()
 
     //first check to see if server closed the connection
     if (match_P(F("*CLOS*"))) {
-        finishCommand();
         debug.println(F("close: got *CLOS*"));
         connected = false;
+        status.tcp = WIFLY_TCP_IDLE;
         return true;
     }
 
@@ -2974,6 +5296,7 @@ boolean WiFly::close()
         finishCommand();
         debug.println(F("close: got *CLOS*"));
         connected = false;
+        status.tcp = WIFLY_TCP_IDLE;
         return true;
     } else {
         debug.println(F("close: failed, no *CLOS*"));
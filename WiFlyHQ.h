@@ -110,6 +110,15 @@ typedef const char PROGMEM prog_char;
 #define WIFLY_DHCP_MODE_CACHE    0x03    /* Use previous DHCP address based on lease */
 #define WIFLY_DHCP_MODE_SERVER   0x04    /* Server DHCP IP addresses? */
 
+/* WLAN authentication modes */
+#define WIFLY_AUTH_OPEN          0x00
+#define WIFLY_AUTH_WEP128        0x01
+#define WIFLY_AUTH_WPA1          0x02
+#define WIFLY_AUTH_MIXED         0x03    /* WPA1 and WPA2-PSK */
+#define WIFLY_AUTH_WPA2_PSK      0x04
+#define WIFLY_AUTH_ADHOC         0x06
+#define WIFLY_AUTH_WEP64         0x08
+
 /* WLAN Join modes */
 #define WIFLY_WLAN_JOIN_MANUAL   0x00    /* Don't auto-join a network */
 #define WIFLY_WLAN_JOIN_AUTO     0x01    /* Auto-join network set in SSID, passkey, and channel. */
@@ -118,6 +127,102 @@ typedef const char PROGMEM prog_char;
 
 #define WIFLY_DEFAULT_TIMEOUT    500    /* 500 milliseconds */
 
+/*
+ * Size of the receive read-ahead buffer of each WiFly. Must be a power
+ * of two, at least 8 (to hold a partial *CLOS* marker) and at most 128.
+ * Define before including WiFlyHQ.h to change it.
+ */
+#ifndef WIFLY_RX_BUFFER_SIZE
+#define WIFLY_RX_BUFFER_SIZE     16
+#endif
+
+#if (WIFLY_RX_BUFFER_SIZE < 8) || (WIFLY_RX_BUFFER_SIZE > 128) || \
+    (WIFLY_RX_BUFFER_SIZE & (WIFLY_RX_BUFFER_SIZE - 1))
+#error "WIFLY_RX_BUFFER_SIZE must be a power of two from 8 to 128"
+#endif
+
+/*
+ * Size of the transmit staging buffer of each WiFly, from 1 to 255.
+ * Commands, and data when write buffering is enabled, are collected here
+ * and passed to the serial interface in blocks.
+ * Define before including WiFlyHQ.h to change it.
+ */
+#ifndef WIFLY_TX_BUFFER_SIZE
+#define WIFLY_TX_BUFFER_SIZE     32
+#endif
+
+#if (WIFLY_TX_BUFFER_SIZE < 1) || (WIFLY_TX_BUFFER_SIZE > 255)
+#error "WIFLY_TX_BUFFER_SIZE must be from 1 to 255"
+#endif
+
+/*
+ * Milliseconds the serial line must be idle before and after $$$ for
+ * the WiFly to enter command mode, see WiFly::setGuardTime().
+ */
+#ifndef WIFLY_GUARD_TIME
+#define WIFLY_GUARD_TIME         250
+#endif
+
+/* Milliseconds the link status is served from cache, see WiFly::setStatusTTL() */
+#ifndef WIFLY_STATUS_TTL
+#define WIFLY_STATUS_TTL         5000
+#endif
+
+/*
+ * Longest wait, in milliseconds, for the WiFly's *READY* after a reboot
+ * or once it is due to wake from sleep.
+ */
+#ifndef WIFLY_BOOT_TIMEOUT
+#define WIFLY_BOOT_TIMEOUT       5000
+#endif
+
+/*
+ * Longest string match() and match_P() build a prefix table for, at a
+ * byte of stack per character. Longer strings are matched without one.
+ */
+#ifndef WIFLY_MATCH_TABLE
+#define WIFLY_MATCH_TABLE        32
+#endif
+
+/* Most set commands a batch leaves waiting for their AOK at once */
+#ifndef WIFLY_BATCH_DEPTH
+#define WIFLY_BATCH_DEPTH        4
+#endif
+
+/*
+ * Number of host name to address lookups each WiFly remembers, 0 for no
+ * DNS cache. Each entry takes WIFLY_DNS_NAME_SIZE + 12 bytes of RAM.
+ * Without a cache, open() passes host names to the WiFly to resolve.
+ * Define before including WiFlyHQ.h to change it.
+ */
+#ifndef WIFLY_DNS_CACHE_SIZE
+#define WIFLY_DNS_CACHE_SIZE     0
+#endif
+
+/*
+ * Characters of each host name the DNS cache keeps, including the null.
+ * Longer names are told apart by the kept characters and a hash.
+ */
+#ifndef WIFLY_DNS_NAME_SIZE
+#define WIFLY_DNS_NAME_SIZE      24
+#endif
+
+/* Milliseconds a cached address is used for, see WiFly::setDnsTTL() */
+#ifndef WIFLY_DNS_TTL
+#define WIFLY_DNS_TTL            300000UL
+#endif
+
+/* Number of options the WiFly can read, see the requests table in WiFlyHQ.cpp */
+#define WIFLY_CONFIG_ITEMS       31
+
+/*
+ * Bytes of option values a WFConfig can hold, at most 255.
+ * Values that don't fit are read from the WiFly when needed.
+ */
+#ifndef WIFLY_CONFIG_POOL_SIZE
+#define WIFLY_CONFIG_POOL_SIZE   224
+#endif
+
 #define WIFLY_MODE_WPA           0    
 #define WIFLY_MODE_WEP_128       1
 #define WIFLY_MODE_WEP_64        2
@@ -138,10 +243,260 @@ private:
     Stream *debug;
 };
 
+/**
+ * Time source for the WiFly. All timeouts and delays used by the
+ * library go through this class. The default implementation uses the
+ * Arduino millis(), micros() and delay() functions; a simulated clock
+ * can be supplied with WiFly::setClock() to run without wall-clock
+ * waits.
+ */
+class WFClock {
+public:
+    virtual uint32_t millis() { return ::millis(); }
+    virtual uint32_t micros() { return ::micros(); }
+    virtual void delay(uint32_t msecs) { ::delay(msecs); }
+    /** Called while polling for data that has not arrived yet. */
+    virtual void idle() { }
+};
+
+/**
+ * Multiple string matcher. Matches a stream of characters against a
+ * set of progmem strings in a single pass (Aho-Corasick). The strings
+ * are compiled into a trie of nodes supplied by the caller; each node
+ * records where to continue after a mismatch so that no input character
+ * is ever rescanned.
+ */
+class WFMatcher {
+public:
+    struct Node {
+        char ch;          /* character that leads to this node */
+        uint8_t child;    /* first child node, 0 = none */
+        uint8_t sibling;  /* next node with the same parent, 0 = none */
+        uint8_t fail;     /* node to continue from after a mismatch */
+        int8_t match;     /* index of the string matched at this node, or -1 */
+    };
+
+    static uint8_t nodesNeeded(const char *str[], uint8_t count);
+    boolean begin(Node *nodes, uint8_t maxNodes, const char *str[], uint8_t count);
+    int8_t step(char ch);
+    void reset() { state = 0; }
+
+private:
+    uint8_t next(uint8_t node, char ch);
+
+    Node *nodes;
+    uint8_t used;
+    uint8_t state;
+    uint8_t first[32];    /* bitmap of the first characters of the strings */
+};
+
+/**
+ * Snapshot of the WiFly configuration, read with one "get everything"
+ * command. Supplied by the sketch, see WiFly::setConfigCache().
+ */
+struct WFConfig {
+    boolean valid;
+    uint32_t taken;                       /* millis() when read */
+    uint8_t used;                         /* bytes of pool used */
+    uint8_t value[WIFLY_CONFIG_ITEMS];    /* offset+1 of each value in pool, 0 = none */
+    char pool[WIFLY_CONFIG_POOL_SIZE];    /* null terminated values */
+};
+
+/* Settings in a WFProfile */
+#define WIFLY_PROFILE_SSID          0x0001
+#define WIFLY_PROFILE_PASSPHRASE    0x0002
+#define WIFLY_PROFILE_AUTH          0x0004
+#define WIFLY_PROFILE_DHCP          0x0008
+#define WIFLY_PROFILE_IP_FLAGS      0x0010
+#define WIFLY_PROFILE_PROTOCOL      0x0020
+#define WIFLY_PROFILE_PORT          0x0040
+#define WIFLY_PROFILE_HOST_IP       0x0080
+#define WIFLY_PROFILE_HOST_PORT     0x0100
+#define WIFLY_PROFILE_UART_MODE     0x0200
+#define WIFLY_PROFILE_FLUSH_TIMEOUT 0x0400
+#define WIFLY_PROFILE_FLUSH_CHAR    0x0800
+#define WIFLY_PROFILE_FLUSH_SIZE    0x1000
+
+/**
+ * Desired WiFly settings, see WiFly::applyProfile(). Only the settings
+ * flagged in fields are applied.
+ */
+struct WFProfile {
+    uint16_t fields;          /* WIFLY_PROFILE_ flags */
+    const char *ssid;
+    const char *passphrase;
+    uint8_t auth;             /* set wlan auth value, e.g. 4 for WPA2-PSK */
+    uint8_t dhcpMode;         /* WIFLY_DHCP_MODE_ value */
+    uint8_t ipFlags;          /* WIFLY_FLAG_ flags */
+    uint8_t protocol;         /* WIFLY_PROTOCOL_ flags */
+    uint16_t port;            /* local port */
+    const char *hostIP;
+    uint16_t hostPort;
+    uint8_t uartMode;         /* WIFLY_UART_MODE_ flags */
+    uint16_t flushTimeout;
+    char flushChar;
+    uint16_t flushSize;
+};
+
+/* WFCommand status */
+#define WIFLY_CMD_IDLE           0    /* not submitted */
+#define WIFLY_CMD_QUEUED         1    /* waiting for earlier commands */
+#define WIFLY_CMD_RUNNING        2    /* sent, waiting for the reply */
+#define WIFLY_CMD_OK             3    /* got the ok reply */
+#define WIFLY_CMD_FAILED         4    /* got the fail reply */
+#define WIFLY_CMD_TIMEOUT        5    /* no reply, or no command mode */
+#define WIFLY_CMD_CANCELLED      6    /* removed with WiFly::cancel() */
+
+/**
+ * A command for the non-blocking command engine, see WiFly::submit().
+ * Supplied by the sketch, and must not be changed or go out of scope
+ * until its status is no longer WIFLY_CMD_QUEUED or WIFLY_CMD_RUNNING.
+ */
+struct WFCommand {
+    const __FlashStringHelper *cmd;   /* command, without the \r */
+    const char *arg;                  /* appended to cmd, or NULL */
+    const __FlashStringHelper *ok;    /* reply meaning success, NULL for "AOK" */
+    const __FlashStringHelper *fail;  /* reply meaning failure, NULL for "ERR:" */
+    uint16_t timeout;                 /* milliseconds to wait for the reply */
+    char *buf;                        /* rest of the ok reply line, or NULL */
+    uint8_t size;                     /* size of buf */
+    void (*done)(WFCommand *cmd, void *context);  /* called on completion, or NULL */
+    uint8_t (*scan)(WFCommand *cmd, char ch);     /* reply parser in place of ok and fail */
+    void *context;                    /* passed to done */
+    uint8_t status;                   /* WIFLY_CMD_ value */
+    WFCommand *next;                  /* next in the queue */
+
+    void begin(const __FlashStringHelper *command, const char *argument=NULL,
+               uint16_t msecs=WIFLY_DEFAULT_TIMEOUT);
+};
+
+/* WFJoin phases */
+#define WIFLY_JOIN_IDLE          0
+#define WIFLY_JOIN_SCANNING      1    /* looking for the network */
+#define WIFLY_JOIN_JOINING       2    /* found it, authenticating */
+#define WIFLY_JOIN_ASSOCIATED    3    /* associated and authenticated */
+#define WIFLY_JOIN_DHCP          4    /* waiting for a DHCP lease */
+#define WIFLY_JOIN_BOUND         5    /* has an IP address, finished */
+#define WIFLY_JOIN_FAILED        6    /* finished, see reason */
+
+/* WFJoin failure reasons */
+#define WIFLY_JOIN_OK            0
+#define WIFLY_JOIN_NOT_FOUND     1    /* network not found */
+#define WIFLY_JOIN_AUTH          2    /* authentication failed */
+#define WIFLY_JOIN_NO_LEASE      3    /* associated, but DHCP failed */
+#define WIFLY_JOIN_TIMEOUT       4
+#define WIFLY_JOIN_CANCELLED     5
+
+/**
+ * An incremental join, see WiFly::joinAsync(). The phase is updated as
+ * the WiFly reports its progress, with the time each phase was reached.
+ */
+struct WFJoin {
+    WFCommand cmd;            /* done and context may be set by the sketch */
+    uint8_t phase;            /* WIFLY_JOIN_ phase */
+    uint8_t reason;           /* WIFLY_JOIN_ failure reason */
+    boolean dhcp;             /* finished at WIFLY_JOIN_BOUND, not WIFLY_JOIN_ASSOCIATED */
+    WFClock *clock;
+    uint32_t started;         /* millis() when the join was queued */
+    uint16_t at[WIFLY_JOIN_FAILED+1];  /* milliseconds from started to each phase */
+    uint8_t matched[7];       /* progress matching each reply */
+    void (*progress)(WFJoin *join, void *context);  /* called on each phase change, or NULL */
+};
+
+/**
+ * The last good association, for a fast reconnect. See
+ * WiFly::saveLink() and WiFly::reconnect().
+ */
+struct WFLink {
+    boolean valid;
+    uint8_t channel;          /* channel the WiFly associated on */
+    uint8_t dhcpMode;         /* configured WIFLY_DHCP_MODE_ value */
+    char ip[16];              /* address when saved */
+};
+
+/**
+ * A piece of a packet for WiFly::writev(), in RAM or PROGMEM.
+ * A size of 0 means data is a null terminated string.
+ */
+struct WFSegment {
+    const void *data;
+    uint16_t size;
+    boolean progmem;
+};
+
+/**
+ * A UDP destination, see WiFly::udpBegin(). The WiFly is left pointed
+ * at the last destination sent to, so further packets to it need no
+ * command mode.
+ */
+struct WFUdpSession {
+    char host[16];            /* destination address */
+    uint16_t port;            /* destination port */
+    uint32_t packets;         /* packets sent */
+    uint32_t bytes;           /* bytes sent */
+    uint16_t switches;        /* times the WiFly was pointed at this destination */
+    uint32_t started;         /* millis() at udpBegin() */
+};
+
+/**
+ * Storage for the setup fingerprint, see WiFly::setFingerprintStore().
+ * Called with save false to read the stored fingerprint, returning 0
+ * if there is none, and with save true to store fingerprint. The
+ * fingerprint is usually kept in EEPROM. When one is set, begin() saves
+ * its settings in the WiFly once and skips them while the stored
+ * fingerprint matches.
+ */
+typedef uint32_t (*WFFingerprintStore)(boolean save, uint32_t fingerprint);
+
+/* WFFrame modes, how a packet is ended before a message that won't fit */
+#define WIFLY_FRAME_SPLIT        0    /* let the flush timer send it */
+#define WIFLY_FRAME_PAD          1    /* pad it out to the flush size */
+
+/**
+ * Framed writer state, see WiFly::frameBegin(). Holds the WiFly's
+ * packet settings and how much of the current packet has been written.
+ */
+struct WFFrame {
+    uint16_t size;            /* FlushSize, 0 if not used */
+    uint16_t timer;           /* FlushTimer in milliseconds, 0 if not used */
+    char match;               /* MatchChar, 0 if not used */
+    uint8_t mode;             /* WIFLY_FRAME_ value */
+    char pad;                 /* padding for WIFLY_FRAME_PAD */
+    uint16_t fill;            /* bytes written towards the current packet */
+    uint32_t messages;        /* messages written */
+    uint32_t crossed;         /* messages that crossed a packet boundary */
+    uint32_t padding;         /* pad bytes written */
+};
+
 class WiFly : public Stream {
 public:
     WiFly();
     
+    void setClock(WFClock *clock);
+    WFClock *getClock() { return clock; }
+
+    void setGuardTime(uint16_t msecs) { guardTime = msecs; }
+    uint16_t getGuardTime() { return guardTime; }
+
+    void setFingerprintStore(WFFingerprintStore store) { fingerprintStore = store; }
+
+    boolean applyProfile(const WFProfile *profile, uint16_t *changed=NULL);
+
+    boolean beginBatch();
+    boolean endBatch(uint32_t *results=NULL);
+
+    boolean submit(WFCommand *cmd);
+    boolean poll();
+    boolean busy() { return (cmdHead != NULL) || (cmdState != 0); }
+    boolean cancel(WFCommand *cmd);
+    boolean joinAsync(WFJoin *join, const char *ssid=NULL, uint16_t timeout=20000);
+    boolean lookupAsync(WFCommand *cmd, const char *hostname, char *buf, int size);
+    boolean pingAsync(WFCommand *cmd, const char *addr);
+
+    void setConfigCache(WFConfig *cache, uint32_t ttl=0);
+    boolean readConfig();
+    void invalidateConfig();
+
     boolean begin(Stream *serialdev, Stream *debugPrint = NULL);
     
     char *getSSID(char *buf, int size);
@@ -166,6 +521,8 @@ public:
     boolean setBaud(uint32_t baud);
     uint32_t getBaud();
     uint8_t getUartMode();
+    uint8_t getAuth();
+    uint8_t getChannel();
     uint8_t getIpFlags();
     uint8_t getProtocol();
 
@@ -221,6 +578,8 @@ public:
     boolean setFlushTimeout(const uint16_t timeout);
     boolean setFlushChar(const char flushChar);
     boolean setFlushSize(uint16_t size);
+    void enableWriteBuffering();
+    void disableWriteBuffering();
     boolean enableDataTrigger(const uint16_t flushtime=10, const char flushChar=0, const uint16_t flushSize=64);
     boolean disableDataTrigger();
     boolean enableUdpAutoPair();
@@ -229,6 +588,8 @@ public:
     boolean setIOFunc(const uint8_t func);
     
     boolean sleep(uint16_t seconds = 0);
+    boolean wakeComplete();
+    uint32_t getBootTime() { return bootTime; }
     
     boolean time();
     char *getTime(char *buf, int size);
@@ -237,6 +598,10 @@ public:
     uint32_t getRTC();
 
     bool getHostByName(const char *hostname, char *buf, int size);
+    void setDnsTTL(uint32_t msecs) { dnsTTL = msecs; }
+    void flushDnsCache();
+    uint16_t getDnsHits() { return dnsHits; }
+    uint16_t getDnsMisses() { return dnsMisses; }
     boolean ping(const char *host);
 
     boolean enableDHCP();
@@ -248,11 +613,24 @@ public:
     boolean join(const char *ssid, const char *password, bool dhcp=true, uint8_t mode=WIFLY_MODE_WPA, uint16_t timeout=20000);
     boolean leave();
     boolean isAssociated();
+    void setStatusTTL(uint32_t msecs) { statusTTL = msecs; }
+    void invalidateStatus() { statusValid = false; }
+    boolean saveLink(WFLink *link);
+    boolean reconnect(WFLink *link, uint16_t timeout=20000);
 
     boolean save();
     boolean reboot();
     boolean factoryRestore();
 
+    boolean udpBegin(WFUdpSession *session, const char *host, uint16_t port);
+    boolean udpSend(WFUdpSession *session, const uint8_t *data, uint16_t size);
+    boolean udpSend(WFUdpSession *session, const char *data);
+    boolean udpSend(WFUdpSession *session, const WFSegment *segs, uint8_t count);
+    uint32_t udpRate(WFUdpSession *session);
+
+    boolean frameBegin(WFFrame *frame, uint8_t mode=WIFLY_FRAME_SPLIT, char pad=0);
+    size_t frameWrite(WFFrame *frame, const uint8_t *data, uint16_t size);
+
     boolean sendto(const uint8_t *data, uint16_t size, const char *host, uint16_t port);
     boolean sendto(const uint8_t *data, uint16_t size, IPAddress host, uint16_t port);
     boolean sendto(const char *data, const char *host, uint16_t port);
@@ -271,10 +649,14 @@ public:
     boolean isInCommandMode();
     
     virtual size_t write(uint8_t byte);
+    virtual size_t write(const uint8_t *buf, size_t size);
+    size_t writev(const WFSegment *segs, uint8_t count);
     virtual int read();
+    int read(uint8_t *buf, size_t size);
     virtual int available();
     virtual void flush();
     virtual int peek();
+    int peek(uint8_t offset);
 
     char *iptoa(IPAddress addr, char *buf, int size);
     IPAddress atoip(char *buf);
@@ -299,6 +681,7 @@ public:
     boolean match(const char *str, uint16_t timeout=WIFLY_DEFAULT_TIMEOUT);
 //    boolean match_P(const __FlashStringHelper *str, uint16_t timeout=WIFLY_DEFAULT_TIMEOUT);
     int multiMatch_P(uint16_t timeout, uint8_t count, ...);
+    int8_t multiMatch_P(const char *str[], uint8_t count, uint16_t timeout=WIFLY_DEFAULT_TIMEOUT);
     int gets(char *buf, int size, uint16_t timeout=WIFLY_DEFAULT_TIMEOUT);
     int getsTerm(char *buf, int size, char term, uint16_t timeout=WIFLY_DEFAULT_TIMEOUT);
     void flushRx(int timeout=WIFLY_DEFAULT_TIMEOUT);
@@ -323,6 +706,8 @@ public:
     boolean match_P(const __FlashStringHelper *str, uint16_t timeout=WIFLY_DEFAULT_TIMEOUT);
 
   private:
+    template <class SerialT> friend class BasicWiFly;
+
     void init(void);
 
     void dump(const char *str);
@@ -334,7 +719,6 @@ public:
     const char *host,
     uint16_t port);
 
-    int8_t multiMatch_P(const char *str[], uint8_t count, uint16_t timeout=WIFLY_DEFAULT_TIMEOUT);
 
     void send_P(const __FlashStringHelper *str);
     void send_P(const char *str);
@@ -342,40 +726,133 @@ public:
     void send(const char ch);
     boolean enterCommandMode();
     boolean exitCommandMode();
-    boolean setPrompt();
+    boolean setPrompt(uint16_t timeout=WIFLY_DEFAULT_TIMEOUT);
+    boolean probePrompt();
+    boolean sendEscape();
+    void guardWait();
+    uint16_t guardLeft();
+    boolean waitReady(uint32_t timeout);
+    boolean asleep();
+    void awake(boolean ready);
     boolean getPrompt(uint16_t timeout=WIFLY_DEFAULT_TIMEOUT);
     boolean checkPrompt(const char *str);
     int getResponse(char *buf, int size, uint16_t timeout=WIFLY_DEFAULT_TIMEOUT);
     boolean readTimeout(char *ch, uint16_t timeout=WIFLY_DEFAULT_TIMEOUT);
+    boolean kmpMatch(const char *str, uint8_t len, boolean flash, uint16_t timeout);
     boolean startCommand();
     boolean finishCommand();
     char *getopt(int opt, char *buf, int size);
+    void queueGetopt(int opt);
+    const char *getCachedOpt(int opt);
+    void parseConfigLine(const char *line, const char *section);
     uint32_t getopt(int opt, uint8_t base=DEC);
     boolean setopt(const __FlashStringHelper *cmd, const char *buf=NULL, const __FlashStringHelper *buf_P=NULL, bool spacesub=false);
     boolean setopt(const char *cmd, const char *buf=NULL, const char *buf_P=NULL, bool spacesub=false);
     boolean setopt(const char *opt, const uint32_t value, uint8_t base=DEC);
     boolean setopt(const __FlashStringHelper *opt, const uint32_t value, uint8_t base=DEC);
     boolean getres(char *buf, int size);
+    boolean batchCollect();
+    boolean udpSelect(WFUdpSession *session);
+    void commandDone(uint8_t status);
 
-    boolean checkStream(const __FlashStringHelper *str, boolean peeked);
-    boolean checkClose(boolean peeked);
-    boolean checkOpen(boolean peeked);
+    void txFlush();
+    void rxPut(char ch);
+    uint8_t rxGet();
+    uint8_t markerFeed(char ch);
+    void markerRelease();
+    void rxFill();
 
     boolean hide();
 
     boolean inCommandMode;
+    boolean modeKnown;     /* inCommandMode is known to match the WiFly */
     int  exitCommand;
+
+    /* Command mode guard */
+    uint32_t lastTx;       /* when the last byte was written to the WiFly */
+    uint16_t guardTime;    /* idle time needed around $$$ */
+
+    /* Command mode prompt, learned from the WiFly */
+    char prompt[16];
+    boolean gotPrompt;
+
+    /* Reboot and sleep */
+    boolean sleeping;      /* rebooting or asleep, waiting for *READY* */
+    uint8_t readyLen;      /* characters of *READY* matched */
+    uint32_t sleepStart;   /* when the reboot or sleep started */
+    uint32_t wakeTime;     /* how long the sleep is, 0 if not known */
+    uint32_t bootTime;     /* how long the last reboot or wake took */
+    uint16_t flushTime;    /* the WiFly's comm time, if set */
     boolean dhcp;
     bool restoreHost;
     bool restoreHostStored;
     char lastHost[32];
     uint16_t lastPort;
+    WFUdpSession *udpDest; /* destination the WiFly is set to, if known */
 
     boolean tcpMode;
     boolean udpAutoPair;
 
     boolean connected;
     boolean connecting;
+    boolean closed;        /* *CLOS* seen, not yet reported by available() */
+
+    /* Batched set commands */
+    boolean batching;
+    boolean batchFailed;   /* a command in this batch failed */
+    uint8_t batchSent;     /* commands sent in this batch */
+    uint8_t batchPending;  /* commands waiting for a result */
+    uint32_t batchResults; /* bit n set if command n succeeded */
+
+    /* Non-blocking command engine */
+    WFCommand *cmdHead;    /* command being run, then the queue */
+    WFCommand *cmdTail;
+    uint8_t cmdState;      /* engine state, 0 = idle */
+    uint8_t cmdOk;         /* characters of the ok reply matched */
+    uint8_t cmdFail;       /* characters of the fail reply matched */
+    uint8_t cmdLen;        /* characters of the reply captured */
+    uint32_t cmdTime;      /* when the state's timeout started */
+
+    /* DNS cache */
+#if WIFLY_DNS_CACHE_SIZE > 0
+    struct {
+        uint32_t hash;     /* hash of the host name, 0 = unused */
+        uint32_t stored;   /* millis() when looked up */
+        uint8_t addr[4];
+        char name[WIFLY_DNS_NAME_SIZE];    /* host name, truncated if too long */
+    } dnsCache[WIFLY_DNS_CACHE_SIZE];
+#endif
+    uint32_t dnsTTL;
+    uint16_t dnsHits;
+    uint16_t dnsMisses;
+
+    uint32_t passHash;     /* hash of the passphrase last set, 0 = not known */
+
+    /* Fast begin() */
+    WFFingerprintStore fingerprintStore;
+    uint32_t optQueued;    /* bit n set if request n was sent ahead */
+    boolean conQueued;     /* show connection was sent ahead */
+
+    /* Configuration snapshot */
+    WFConfig *config;
+    uint32_t configTTL;
+
+    /* Transmit staging buffer */
+    uint8_t txBuf[WIFLY_TX_BUFFER_SIZE];
+    uint8_t txCount;       /* number of bytes staged */
+    uint8_t txThreshold;   /* send when this many are staged */
+    boolean txBuffering;   /* stage data mode writes as well as commands */
+
+    /* Receive read-ahead buffer */
+    char rxBuf[WIFLY_RX_BUFFER_SIZE];
+    uint8_t rxHead;        /* new characters stored here */
+    uint8_t rxTail;        /* characters read from here */
+    uint8_t rxCount;       /* number of characters in the buffer */
+
+    /* Partially matched *OPEN* or *CLOS* marker */
+    uint8_t markerLen;     /* number of marker characters matched */
+    uint8_t markerMask;    /* markers still matching */
+    uint32_t markerTime;   /* when the last marker character arrived */
     struct {
     uint8_t tcp;
     uint8_t assoc;
@@ -385,9 +862,14 @@ public:
     uint8_t channel;
     } status;
 
+    boolean statusValid;   /* status holds the WiFly's link status */
+    uint32_t statusTime;   /* when status was last read from the WiFly */
+    uint32_t statusTTL;
+
     Stream *serial;    /* Serial interface to WiFly */
     
     WFDebug debug;    /* Internal debug channel. */
+    WFClock *clock;   /* Time source for timeouts and delays */
 
     char replaceChar;    /* The space replacement character */
 
@@ -395,6 +877,121 @@ public:
     char *dbgBuf;
     int dbgInd;
     int dbgMax;
+    int dbgRead;      /* characters read, numbers the debugOn output */
+};
+
+/**
+ * A WiFly bound at compile time to a concrete serial class, e.g.
+ * BasicWiFly<HardwareSerial> or BasicWiFly<SoftwareSerial>. The data
+ * mode reads and writes call SerialT directly rather than through
+ * Stream's virtual functions, so the compiler can inline the UART
+ * accessors. Anything else (command mode, held back bytes, partial
+ * markers, staged writes) goes through WiFly as usual.
+ * SerialT must implement available(), read(), peek() and write()
+ * itself, they can't be Stream's pure virtual functions.
+ * Until begin() there is no serial interface: nothing is available or
+ * read, and writes are dropped.
+ */
+template <class SerialT>
+class BasicWiFly : public WiFly {
+public:
+    BasicWiFly() : uart(NULL) { }
+
+    boolean begin(SerialT *serialdev, Stream *debugPrint = NULL)
+    {
+        uart = serialdev;
+        return WiFly::begin(serialdev, debugPrint);
+    }
+
+    virtual int available()
+    {
+        if (txCount || rxCount || markerLen || closed || (uart == NULL)) {
+            return uart ? WiFly::available() : 0;
+        }
+
+        int count = uart->SerialT::available();
+        if ((count > 0) && (uart->SerialT::peek() == '*')) {
+            /* may be a marker */
+            return WiFly::available();
+        }
+        return count;
+    }
+
+    virtual int read()
+    {
+        if (uart == NULL) {
+            return -1;
+        }
+        if ((txCount == 0) && (rxCount == 0) && (markerLen == 0)) {
+            int data = uart->SerialT::read();
+            if (data != '*') {
+                return data;
+            }
+            markerFeed(data);
+        }
+        return WiFly::read();
+    }
+
+    int read(uint8_t *buf, size_t size)
+    {
+        size_t count = 0;
+        int data;
+
+        if (txCount || rxCount || markerLen || (uart == NULL)) {
+            return uart ? WiFly::read(buf, size) : 0;
+        }
+
+        while (count < size) {
+            data = uart->SerialT::read();
+            if (data < 0) {
+                break;
+            }
+            if (data == '*') {
+                /* Let WiFly follow the marker */
+                markerFeed(data);
+                data = WiFly::read(&buf[count], size - count);
+                if (data >= 0) {
+                    return count + data;
+                }
+                if (count == 0) {
+                    return -1;
+                }
+                /* report the close on the next read */
+                closed = true;
+                return count;
+            }
+            buf[count++] = (uint8_t)data;
+        }
+
+        if ((count == 0) && closed) {
+            closed = false;
+            return -1;
+        }
+        return count;
+    }
+
+    virtual size_t write(uint8_t byte)
+    {
+        if (txBuffering || inCommandMode || txCount || (dbgInd < dbgMax) || (uart == NULL)) {
+            return uart ? WiFly::write(byte) : 0;
+        }
+        lastTx = clock->millis();
+        return uart->SerialT::write(byte);
+    }
+
+    virtual size_t write(const uint8_t *buf, size_t size)
+    {
+        if (txBuffering || inCommandMode || txCount || (dbgInd < dbgMax) || (uart == NULL)) {
+            return uart ? WiFly::write(buf, size) : 0;
+        }
+        lastTx = clock->millis();
+        return uart->SerialT::write(buf, size);
+    }
+
+    using WiFly::write;
+
+private:
+    SerialT *uart;    /* the same interface as serial */
 };
 
 #endif
@@ -103,7 +103,11 @@ void loop()
 	if (available < 0) {
 	    Serial.println("Disconnected");
 	} else if (available > 0) {
-	    Serial.write(wifly.read());
+	    uint8_t buf[32];
+	    int len = wifly.read(buf, sizeof(buf));
+	    if (len > 0) {
+		Serial.write(buf, len);
+	    }
 	} else {
 	    /* Disconnect after 10 seconds */
 	    if ((millis() - connectTime) > 10000) {
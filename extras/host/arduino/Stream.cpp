@@ -0,0 +1,227 @@
+/*-
+ * Copyright (c) 2012,2013 Darran Hunt (darran [at] hunt dot net dot nz)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file Stream.cpp
+ *
+ * @brief Host implementation of the Arduino Stream class.
+ */
+
+#include "Arduino.h"
+
+#define NO_SKIP_CHAR  1  /* a magic char not found in a valid ASCII numeric field */
+
+/* Read a character, waiting up to the stream timeout */
+int Stream::timedRead()
+{
+    int c;
+    _startMillis = millis();
+    do {
+        c = read();
+        if (c >= 0) return c;
+        yield();
+    } while (millis() - _startMillis < _timeout);
+    return -1;
+}
+
+/* Peek a character, waiting up to the stream timeout */
+int Stream::timedPeek()
+{
+    int c;
+    _startMillis = millis();
+    do {
+        c = peek();
+        if (c >= 0) return c;
+        yield();
+    } while (millis() - _startMillis < _timeout);
+    return -1;
+}
+
+/* Return the next numeric digit in the stream or -1 if timeout.
+ * Discards non-numeric characters.
+ */
+int Stream::peekNextDigit()
+{
+    int c;
+    while (1) {
+        c = timedPeek();
+        if (c < 0) return c;
+        if (c == '-') return c;
+        if (c >= '0' && c <= '9') return c;
+        read();
+    }
+}
+
+void Stream::setTimeout(unsigned long timeout)
+{
+    _timeout = timeout;
+}
+
+bool Stream::find(char *target)
+{
+    return findUntil(target, NULL);
+}
+
+bool Stream::find(char *target, size_t length)
+{
+    return findUntil(target, length, NULL, 0);
+}
+
+bool Stream::findUntil(char *target, char *terminator)
+{
+    return findUntil(target, strlen(target), terminator, terminator ? strlen(terminator) : 0);
+}
+
+bool Stream::findUntil(char *target, size_t targetLen, char *terminator, size_t termLen)
+{
+    size_t index = 0;
+    size_t termIndex = 0;
+    int c;
+
+    if (*target == 0) {
+        return true;
+    }
+    while ((c = timedRead()) > 0) {
+        if (c != target[index]) {
+            index = 0;
+        }
+        if (c == target[index]) {
+            if (++index >= targetLen) {
+                return true;
+            }
+        }
+        if (termLen > 0 && c == terminator[termIndex]) {
+            if (++termIndex >= termLen) {
+                return false;
+            }
+        } else {
+            termIndex = 0;
+        }
+    }
+    return false;
+}
+
+long Stream::parseInt()
+{
+    return parseInt(NO_SKIP_CHAR);
+}
+
+long Stream::parseInt(char skipChar)
+{
+    bool isNegative = false;
+    long value = 0;
+    int c;
+
+    c = peekNextDigit();
+    if (c < 0) {
+        return 0;
+    }
+
+    do {
+        if (c == skipChar) {
+            /* ignore this charactor */
+        } else if (c == '-') {
+            isNegative = true;
+        } else if (c >= '0' && c <= '9') {
+            value = value * 10 + c - '0';
+        }
+        read();
+        c = timedPeek();
+    } while ((c >= '0' && c <= '9') || c == skipChar);
+
+    if (isNegative) {
+        value = -value;
+    }
+    return value;
+}
+
+float Stream::parseFloat()
+{
+    return parseFloat(NO_SKIP_CHAR);
+}
+
+float Stream::parseFloat(char skipChar)
+{
+    bool isNegative = false;
+    bool isFraction = false;
+    long value = 0;
+    int c;
+    float fraction = 1.0;
+
+    c = peekNextDigit();
+    if (c < 0) {
+        return 0;
+    }
+
+    do {
+        if (c == skipChar) {
+            /* ignore */
+        } else if (c == '-') {
+            isNegative = true;
+        } else if (c == '.') {
+            isFraction = true;
+        } else if (c >= '0' && c <= '9') {
+            value = value * 10 + c - '0';
+            if (isFraction) {
+                fraction *= 0.1f;
+            }
+        }
+        read();
+        c = timedPeek();
+    } while ((c >= '0' && c <= '9') || c == '.' || c == skipChar);
+
+    if (isNegative) {
+        value = -value;
+    }
+    if (isFraction) {
+        return value * fraction;
+    }
+    return value;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+    size_t count = 0;
+    while (count < length) {
+        int c = timedRead();
+        if (c < 0) break;
+        *buffer++ = (char)c;
+        count++;
+    }
+    return count;
+}
+
+size_t Stream::readBytesUntil(char terminator, char *buffer, size_t length)
+{
+    if (length < 1) return 0;
+    size_t index = 0;
+    while (index < length) {
+        int c = timedRead();
+        if (c < 0 || c == terminator) break;
+        *buffer++ = (char)c;
+        index++;
+    }
+    return index;
+}
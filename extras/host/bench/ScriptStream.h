@@ -0,0 +1,61 @@
+/*-
+ * Copyright (c) 2012,2013 Darran Hunt (darran [at] hunt dot net dot nz)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file ScriptStream.h
+ *
+ * @brief A Stream that replays a fixed block of bytes and discards
+ *        anything written to it.
+ */
+
+#ifndef _SCRIPTSTREAM_H_
+#define _SCRIPTSTREAM_H_
+
+#include <string>
+
+#include <Arduino.h>
+
+class ScriptStream : public Stream {
+public:
+    ScriptStream() : pos(0), written(0) {}
+
+    void load(const std::string &data) { input = data; pos = 0; }
+    size_t bytesWritten() const { return written; }
+
+    virtual int available() { return input.size() - pos; }
+    virtual int read() { return pos < input.size() ? (uint8_t)input[pos++] : -1; }
+    virtual int peek() { return pos < input.size() ? (uint8_t)input[pos] : -1; }
+    virtual void flush() {}
+    virtual size_t write(uint8_t) { written++; return 1; }
+
+    using Print::write;
+
+private:
+    std::string input;
+    size_t pos;
+    size_t written;
+};
+
+#endif
@@ -0,0 +1,231 @@
+/*-
+ * Copyright (c) 2012,2013 Darran Hunt (darran [at] hunt dot net dot nz)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host benchmark of the data mode hot path through a Stream pointer
+ * (WiFly) and bound to the serial class at compile time (BasicWiFly).
+ *
+ * Each form reads and writes the same data, first through ScriptStream,
+ * whose accessors can be inlined, then through the RN-XV emulator over
+ * an open TCP connection. Reports CPU cycles per byte, or nanoseconds
+ * per byte where there is no cycle counter.
+ *
+ * usage: bench_bind [kbytes]
+ */
+
+#include <stdio.h>
+#include <string>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <WiFlyHQ.h>
+#include <RNXVEmulator.h>
+#include <SimClock.h>
+
+#include "ScriptStream.h"
+
+/* begin() sets up the module in one command mode session */
+static const char startup[] =
+    "CMD\r\n"
+    "<2.32> \r\n"
+    "AOK\r\n<2.32> AOK\r\n<2.32> AOK\r\n<2.32> "
+    "8111\r\n<2.32> "
+    "DHCP=ON\r\n<2.32> "
+    "Replace=0x24\r\n<2.32> "
+    "EXIT\r\n";
+
+#if defined(__x86_64__) || defined(__i386__)
+static const char unit[] = "cycles/byte";
+
+static uint64_t ticks()
+{
+    return __rdtsc();
+}
+#else
+static const char unit[] = "ns/byte";
+
+static uint64_t ticks()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static bool failed;
+
+static void report(const char *name, const char *form, uint64_t elapsed, size_t bytes, size_t expected)
+{
+    printf("%-24s %-24s %8.2f %s\n", name, form, bytes ? (double)elapsed / bytes : 0.0, unit);
+    if (bytes != expected) {
+        fprintf(stderr, "%s %s: expected %zu bytes, got %zu\n", name, form, expected, bytes);
+        failed = true;
+    }
+}
+
+/* The same loops for either form */
+template <class W>
+static void readLoops(W &wifly, ScriptStream &serial, const std::string &payload, const char *form)
+{
+    uint8_t buf[64];
+    size_t count;
+    uint64_t start;
+    int len;
+
+    serial.load(payload);
+    count = 0;
+    start = ticks();
+    while (wifly.read() >= 0) {
+        count++;
+    }
+    report("read()", form, ticks() - start, count, payload.size());
+
+    serial.load(payload);
+    count = 0;
+    start = ticks();
+    while (wifly.available() > 0) {
+        wifly.read();
+        count++;
+    }
+    report("available(), read()", form, ticks() - start, count, payload.size());
+
+    serial.load(payload);
+    count = 0;
+    start = ticks();
+    while ((len = wifly.read(buf, sizeof(buf))) > 0) {
+        count += len;
+    }
+    report("read(buf, 64)", form, ticks() - start, count, payload.size());
+
+    size_t written = serial.bytesWritten();
+    start = ticks();
+    for (size_t ind=0; ind<payload.size(); ind++) {
+        wifly.write((uint8_t)payload[ind]);
+    }
+    report("write()", form, ticks() - start, serial.bytesWritten() - written, payload.size());
+}
+
+template <class W>
+static void emulatorLoop(W &wifly, RNXVEmulator &module, SimClock &sim, const std::string &payload,
+                         const char *form)
+{
+    size_t count = 0;
+    int avail;
+
+    module.setAssociated(true);
+    module.setClock(&sim);
+    sim.attach(&module);
+    wifly.setClock(&sim);
+    if (!wifly.begin(&module) || !wifly.open("192.168.1.20", 80)) {
+        fprintf(stderr, "%s: failed to connect\n", form);
+        failed = true;
+        return;
+    }
+
+    module.remoteSend(payload.c_str());
+    module.remoteClose();
+    uint64_t start = ticks();
+    while ((avail = wifly.available()) >= 0) {
+        if (avail > 0) {
+            wifly.read();
+            count++;
+        }
+    }
+    report("emulator read()", form, ticks() - start, count, payload.size());
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = 1024 * 1024;
+
+    if (argc > 1) {
+        size = atol(argv[1]) * 1024;
+    }
+
+    std::string payload;
+    while (payload.size() < size) {
+        payload += "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ\r\n";
+    }
+    payload.resize(size);
+
+    {
+        /* nothing to read or write to before begin() */
+        BasicWiFly<ScriptStream> wifly;
+        uint8_t buf[4];
+
+        if ((wifly.available() != 0) || (wifly.read() != -1) || (wifly.read(buf, sizeof(buf)) != 0) ||
+            (wifly.write((uint8_t)'x') != 0) || (wifly.write(buf, sizeof(buf)) != 0)) {
+            fprintf(stderr, "BasicWiFly used before begin()\n");
+            failed = true;
+        }
+    }
+
+    {
+        ScriptStream serial;
+        SimClock sim;
+        WiFly wifly;
+
+        wifly.setClock(&sim);
+        serial.load(startup);
+        if (!wifly.begin(&serial)) {
+            fprintf(stderr, "begin failed\n");
+            return 1;
+        }
+        readLoops(wifly, serial, payload, "WiFly");
+    }
+
+    {
+        ScriptStream serial;
+        SimClock sim;
+        BasicWiFly<ScriptStream> wifly;
+
+        wifly.setClock(&sim);
+        serial.load(startup);
+        if (!wifly.begin(&serial)) {
+            fprintf(stderr, "begin failed\n");
+            return 1;
+        }
+        readLoops(wifly, serial, payload, "BasicWiFly<ScriptStream>");
+    }
+
+    /* the emulator is much slower than a UART, so use less data */
+    payload.resize(size / 8);
+    {
+        RNXVEmulator module;
+        SimClock sim;
+        WiFly wifly;
+        emulatorLoop(wifly, module, sim, payload, "WiFly");
+    }
+    {
+        RNXVEmulator module;
+        SimClock sim;
+        BasicWiFly<RNXVEmulator> wifly;
+        emulatorLoop(wifly, module, sim, payload, "BasicWiFly<RNXVEmulator>");
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,322 @@
+/*-
+ * Copyright (c) 2012,2013 Darran Hunt (darran [at] hunt dot net dot nz)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Host benchmark for match() and match_P().
+ *
+ * Scans HTTP and SOAP responses of the kind handled by the
+ * bandwidth_fritz example for the tokens that example looks for.
+ * match_P() is timed end to end through a WiFly. The restart-on-mismatch
+ * scan that match_P() used before it switched to a prefix table, and the
+ * prefix table scan itself, are also timed over the same bytes held in
+ * memory so the two algorithms can be compared without the serial path.
+ * Also checks a self-overlapping string that the old scan misses, and
+ * one too long for a prefix table, from progmem and from RAM.
+ */
+
+#include <stdio.h>
+#include <string>
+
+#include <WiFlyHQ.h>
+
+#include "ScriptStream.h"
+#include "SimClock.h"
+
+static const char startup[] =
+    "CMD\r\n"
+    "<2.32> \r\n"
+    "AOK\r\n<2.32> AOK\r\n<2.32> AOK\r\n<2.32> "
+    "8111\r\n<2.32> "
+    "DHCP=ON\r\n<2.32> "
+    "Replace=0x24\r\n<2.32> "
+    "EXIT\r\n";
+
+static const char soapResponse[] =
+    "HTTP/1.1 200 OK\r\n"
+    "DATE: Mon, 11 Mar 2013 10:24:31 GMT\r\n"
+    "SERVER: FRITZ!Box Fon WLAN 7340 UPnP/1.0 AVM FRITZ!Box Fon WLAN 7340 99.05.05\r\n"
+    "CONTENT-LENGTH: 1018\r\n"
+    "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+    "EXT:\r\n"
+    "\r\n"
+    "<?xml version=\"1.0\"?>\n"
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\n"
+    "<s:Body>\n"
+    "<u:GetAddonInfosResponse xmlns:u=\"urn:schemas-upnp-org:service:WANCommonInterfaceConfig:1\">\n"
+    "<NewByteSendRate>2847</NewByteSendRate>\n"
+    "<NewByteReceiveRate>31904</NewByteReceiveRate>\n"
+    "<NewPacketSendRate>21</NewPacketSendRate>\n"
+    "<NewPacketReceiveRate>27</NewPacketReceiveRate>\n"
+    "<NewTotalBytesSent>131843765</NewTotalBytesSent>\n"
+    "<NewTotalBytesReceived>2170151543</NewTotalBytesReceived>\n"
+    "<NewAutoDisconnectTime>0</NewAutoDisconnectTime>\n"
+    "<NewIdleDisconnectTime>0</NewIdleDisconnectTime>\n"
+    "<NewDNSServer1>217.237.150.115</NewDNSServer1>\n"
+    "<NewDNSServer2>217.237.148.102</NewDNSServer2>\n"
+    "<NewVoipDNSServer1>217.237.150.115</NewVoipDNSServer1>\n"
+    "<NewVoipDNSServer2>217.237.148.102</NewVoipDNSServer2>\n"
+    "<NewUpnpControlEnabled>1</NewUpnpControlEnabled>\n"
+    "<NewRoutedBridgedModeBoth>1</NewRoutedBridgedModeBoth>\n"
+    "</u:GetAddonInfosResponse>\n"
+    "</s:Body>\n"
+    "</s:Envelope>\n";
+
+static const char httpResponse[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Mon, 11 Mar 2013 10:24:31 GMT\r\n"
+    "Server: Apache/2.2.22 (Ubuntu)\r\n"
+    "Last-Modified: Sun, 10 Mar 2013 21:02:11 GMT\r\n"
+    "ETag: \"2c1b0e-2f5-4d7981c3b8a40\"\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Content-Length: 757\r\n"
+    "Connection: close\r\n"
+    "Content-Type: text/html; charset=UTF-8\r\n"
+    "\r\n"
+    "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.0 Strict//EN\"\n"
+    "  \"http://www.w3.org/TR/xhtml1/DTD/xhtml1-strict.dtd\">\n"
+    "<html><head><title>WiFlyHQ</title>\n"
+    "<meta http-equiv=\"Content-Type\" content=\"text/html; charset=UTF-8\" />\n"
+    "</head><body>\n"
+    "<table><tr><td>temperature</td><td>21.5</td></tr>\n"
+    "<tr><td>humidity</td><td>48</td></tr>\n"
+    "<tr><td>pressure</td><td>1013</td></tr></table>\n"
+    "</body></html>\n";
+
+/* The tokens bandwidth_fritz.ino scans a GetAddonInfos response for */
+static const char tok_date[] PROGMEM = "DATE: ";
+static const char tok_send[] PROGMEM = "<NewByteSendRate>";
+static const char tok_recv[] PROGMEM = "<NewByteReceiveRate>";
+
+/* Tokens from an HTTP client */
+static const char tok_length[] PROGMEM = "Content-Length: ";
+static const char tok_body[] PROGMEM = "\r\n\r\n";
+static const char tok_pressure[] PROGMEM = "pressure</td><td>";
+
+/* Needs a fallback to a partial match, not a restart */
+static const char tok_overlap[] PROGMEM = "<</b>";
+static const char overlapInput[] = "a<<</b>c";
+/* Longer than WIFLY_MATCH_TABLE */
+static const char tok_longOverlap[] PROGMEM = "<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<</b>";
+static const char longOverlap[] = "<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<</b>";
+static const char longOverlapInput[] = "a<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<</b>c";
+
+/** The restart-on-mismatch scan previously used by match_P() */
+static bool naiveMatch_P(const std::string &data, size_t &pos, const char *str)
+{
+    const char *match = str;
+    char ch_P = pgm_read_byte(str);
+
+    while (pos < data.size()) {
+        char ch = data[pos++];
+        if (ch == ch_P) {
+            match++;
+        } else {
+            match = str;
+            if (ch == pgm_read_byte(match)) {
+                match++;
+            }
+        }
+        ch_P = pgm_read_byte(match);
+        if (ch_P == '\0') {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/** The prefix table scan used by match_P() */
+static bool prefixMatch_P(const std::string &data, size_t &pos, const char *str)
+{
+    uint8_t len = strlen_P(str);
+    uint8_t prefix[len];
+    char buf[len];
+    uint8_t matched = 0;
+
+    memcpy_P(buf, str, len);
+    prefix[0] = 0;
+    for (uint8_t ind=1; ind<len; ind++) {
+        while ((matched > 0) && (buf[ind] != buf[matched])) {
+            matched = prefix[matched-1];
+        }
+        if (buf[ind] == buf[matched]) {
+            matched++;
+        }
+        prefix[ind] = matched;
+    }
+
+    matched = 0;
+    while (pos < data.size()) {
+        char ch = data[pos++];
+        while ((matched > 0) && (ch != buf[matched])) {
+            matched = prefix[matched-1];
+        }
+        if ((ch == buf[matched]) && (++matched == len)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static double seconds(unsigned long startUs)
+{
+    return (micros() - startUs) / 1000000.0;
+}
+
+static void report(const char *name, size_t bytes, double secs)
+{
+    printf("%-24s %10zu bytes %8.3f s %12.0f bytes/s\n",
+           name, bytes, secs, secs > 0 ? bytes / secs : 0.0);
+}
+
+/**
+ * Scan repeat copies of response for each token in turn with
+ * match_P(), the prefix table scan and the old scan.
+ * @returns true if all three found every token in every copy
+ */
+static bool run(WiFly &wifly, ScriptStream &serial, const char *name,
+                const char *response, const char *tokens[], int count, int repeat)
+{
+    std::string payload;
+    std::string label;
+    unsigned long start;
+    size_t pos;
+    int found;
+
+    for (int ind=0; ind<repeat; ind++) {
+        payload += response;
+    }
+
+    serial.load(payload);
+    found = 0;
+    start = micros();
+    for (int ind=0; ind<repeat; ind++) {
+        for (int tok=0; tok<count; tok++) {
+            if (wifly.match_P(tokens[tok], 10)) {
+                found++;
+            }
+        }
+    }
+    label = std::string(name) + " match_P()";
+    report(label.c_str(), payload.size(), seconds(start));
+    if (found != repeat * count) {
+        fprintf(stderr, "%s: expected %d matches, got %d\n", label.c_str(), repeat * count, found);
+        return false;
+    }
+
+    found = 0;
+    pos = 0;
+    start = micros();
+    for (int ind=0; ind<repeat; ind++) {
+        for (int tok=0; tok<count; tok++) {
+            if (prefixMatch_P(payload, pos, tokens[tok])) {
+                found++;
+            }
+        }
+    }
+    label = std::string(name) + " prefix scan";
+    report(label.c_str(), payload.size(), seconds(start));
+    if (found != repeat * count) {
+        fprintf(stderr, "%s: expected %d matches, got %d\n", label.c_str(), repeat * count, found);
+        return false;
+    }
+
+    found = 0;
+    pos = 0;
+    start = micros();
+    for (int ind=0; ind<repeat; ind++) {
+        for (int tok=0; tok<count; tok++) {
+            if (naiveMatch_P(payload, pos, tokens[tok])) {
+                found++;
+            }
+        }
+    }
+    label = std::string(name) + " old scan";
+    report(label.c_str(), payload.size(), seconds(start));
+    if (found != repeat * count) {
+        fprintf(stderr, "%s: expected %d matches, got %d\n", label.c_str(), repeat * count, found);
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    ScriptStream serial;
+    SimClock sim;
+    WiFly wifly;
+    size_t pos;
+    int repeat = 10000;
+    const char *soapTokens[] = { tok_date, tok_send, tok_recv };
+    const char *httpTokens[] = { tok_length, tok_body, tok_pressure };
+
+    if (argc > 1) {
+        repeat = atoi(argv[1]);
+    }
+
+    wifly.setClock(&sim);
+
+    serial.load(startup);
+    if (!wifly.begin(&serial)) {
+        fprintf(stderr, "begin failed\n");
+        return 1;
+    }
+
+    if (!run(wifly, serial, "SOAP", soapResponse, soapTokens, 3, repeat)) {
+        return 1;
+    }
+    if (!run(wifly, serial, "HTTP", httpResponse, httpTokens, 3, repeat)) {
+        return 1;
+    }
+
+    std::string overlap(overlapInput);
+    pos = 0;
+    printf("%-24s %s\n", "overlap old scan", naiveMatch_P(overlap, pos, tok_overlap) ? "found" : "missed");
+    serial.load(overlap);
+    if (!wifly.match_P(tok_overlap, 10)) {
+        fprintf(stderr, "overlap: match_P() missed \"<</b>\"\n");
+        return 1;
+    }
+    printf("%-24s %s\n", "overlap match_P()", "found");
+
+    serial.load(longOverlapInput);
+    if (!wifly.match_P(tok_longOverlap, 10)) {
+        fprintf(stderr, "long overlap: match_P() missed\n");
+        return 1;
+    }
+    serial.load(longOverlapInput);
+    if (!wifly.match(longOverlap, 10)) {
+        fprintf(stderr, "long overlap: match() missed\n");
+        return 1;
+    }
+    printf("%-24s %s\n", "long overlap match()", "found");
+
+    return 0;
+}
@@ -0,0 +1,219 @@
+/*-
+ * Copyright (c) 2012,2013 Darran Hunt (darran [at] hunt dot net dot nz)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host benchmark of several WiFly modules driven from one sketch.
+ *
+ * Each module is an emulator with its own firmware version, and so its
+ * own prompt, and its own SSID. The modules are started and queried one
+ * after another, then all receive and send at once, serviced round
+ * robin. Every module must see only its own prompt, settings and data.
+ * Reports the receive rate of one module on its own and the aggregate
+ * rate of all of them. Runs in simulated time.
+ *
+ * usage: bench_multi [modules] [baud]
+ */
+
+#include <stdio.h>
+#include <string>
+
+#include <WiFlyHQ.h>
+#include <RNXVEmulator.h>
+#include <SimClock.h>
+
+#define MAX_MODULES 8
+
+static const char *versions[MAX_MODULES] = {
+    "2.32", "2.38", "4.00", "4.41", "2.30", "2.36", "4.40", "2.45"
+};
+
+static bool failed;
+
+static void check(bool ok, const char *what, int module)
+{
+    if (!ok) {
+        fprintf(stderr, "module %d: %s failed\n", module, what);
+        failed = true;
+    }
+}
+
+/* Data for one module, so a mix-up between modules is caught */
+static std::string payload(int module, size_t size)
+{
+    std::string data;
+    char line[32];
+
+    for (int ind=0; data.size() < size; ind++) {
+        snprintf(line, sizeof(line), "module %d line %d\r\n", module, ind);
+        data += line;
+    }
+    data.resize(size);
+    return data;
+}
+
+/**
+ * Receive a payload on each of the first count modules at once.
+ * @returns the number of bytes received per second, in simulated time
+ */
+static unsigned long receive(SimClock &sim, RNXVEmulator *module, WiFly *wifly, int count, size_t size)
+{
+    std::string received[MAX_MODULES];
+    bool done[MAX_MODULES];
+    int left = count;
+    uint8_t buf[64];
+
+    for (int ind=0; ind<count; ind++) {
+        module[ind].remoteSend(payload(ind, size).c_str());
+        module[ind].remoteClose();
+        done[ind] = false;
+    }
+
+    uint32_t start = sim.millis();
+    while (left > 0) {
+        bool idle = true;
+        for (int ind=0; ind<count; ind++) {
+            if (done[ind]) {
+                continue;
+            }
+            int avail = wifly[ind].available();
+            if (avail < 0) {
+                done[ind] = true;
+                left--;
+            } else if (avail > 0) {
+                int len = wifly[ind].read(buf, sizeof(buf));
+                if (len > 0) {
+                    received[ind].append((const char *)buf, len);
+                }
+                idle = false;
+            }
+        }
+        if (idle) {
+            sim.idle();
+        }
+    }
+    uint32_t msecs = sim.millis() - start;
+
+    size_t total = 0;
+    for (int ind=0; ind<count; ind++) {
+        check(received[ind] == payload(ind, size), "receive", ind);
+        total += received[ind].size();
+    }
+    return msecs ? total * 1000 / msecs : 0;
+}
+
+int main(int argc, char **argv)
+{
+    static RNXVEmulator module[MAX_MODULES];
+    static WiFly wifly[MAX_MODULES];
+    SimClock sim;
+    char buf[32];
+    char ssid[16];
+    int count = 4;
+    uint32_t baud = 230400;
+    size_t size = 16384;
+
+    if (argc > 1) {
+        count = atoi(argv[1]);
+        if ((count < 1) || (count > MAX_MODULES)) {
+            fprintf(stderr, "modules must be from 1 to %d\n", MAX_MODULES);
+            return 1;
+        }
+    }
+    if (argc > 2) {
+        baud = atol(argv[2]);
+    }
+
+    for (int ind=0; ind<count; ind++) {
+        snprintf(ssid, sizeof(ssid), "gateway%d", ind);
+        module[ind].setVersion(versions[ind]);
+        module[ind].setOption("wlan ssid", ssid);
+        module[ind].setAssociated(true, 1 + ind);
+        module[ind].setBaud(baud);
+        module[ind].setLatency(200);
+        module[ind].setClock(&sim);
+        sim.attach(&module[ind]);
+        wifly[ind].setClock(&sim);
+    }
+    printf("%-24s %6d\n", "modules", count);
+
+    /* each module learns its own prompt and reads its own settings */
+    uint32_t start = sim.millis();
+    for (int ind=0; ind<count; ind++) {
+        check(wifly[ind].begin(&module[ind]), "begin", ind);
+    }
+    for (int ind=0; ind<count; ind++) {
+        snprintf(ssid, sizeof(ssid), "gateway%d", ind);
+        check(strcmp(wifly[ind].getSSID(buf, sizeof(buf)), ssid) == 0, "getSSID", ind);
+        check(wifly[ind].setDeviceID(ssid), "setDeviceID", ind);
+        check(strcmp(module[ind].getOption("opt deviceid"), ssid) == 0, "device ID", ind);
+    }
+    printf("%-24s %6lu ms\n", "setup", (unsigned long)(sim.millis() - start));
+    if (failed) {
+        return 1;
+    }
+
+    /* one module on its own, then all of them at once */
+    if (!wifly[0].open("192.168.1.20", 80)) {
+        check(false, "open", 0);
+        return 1;
+    }
+    unsigned long single = receive(sim, module, wifly, 1, size);
+    printf("%-24s %6lu bytes/s at %lu baud\n", "receive x1", single, (unsigned long)baud);
+
+    for (int ind=0; ind<count; ind++) {
+        if (!wifly[ind].open("192.168.1.20", 80)) {
+            check(false, "open", ind);
+            return 1;
+        }
+    }
+    unsigned long aggregate = receive(sim, module, wifly, count, size);
+    printf("%-24s %6lu bytes/s at %lu baud\n", count > 1 ? "receive aggregate" : "receive", aggregate,
+           (unsigned long)baud);
+
+    /* each module sends only what its own WiFly wrote */
+    for (int ind=0; ind<count; ind++) {
+        check(wifly[ind].open("192.168.1.20", 80), "open", ind);
+        module[ind].clearSent();
+    }
+    for (int line=0; line<50; line++) {
+        for (int ind=0; ind<count; ind++) {
+            wifly[ind].print(F("module "));
+            wifly[ind].print(ind);
+            wifly[ind].println(F(" reading"));
+        }
+    }
+    for (int ind=0; ind<count; ind++) {
+        std::string expect;
+        for (int line=0; line<50; line++) {
+            snprintf(buf, sizeof(buf), "module %d reading\r\n", ind);
+            expect += buf;
+        }
+        check(module[ind].sent() == expect, "send", ind);
+        wifly[ind].close();
+    }
+    printf("%-24s %6s\n", "isolation", failed ? "FAILED" : "ok");
+
+    return failed ? 1 : 0;
+}
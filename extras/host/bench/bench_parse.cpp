@@ -0,0 +1,189 @@
+/*-
+ * Copyright (c) 2012,2013 Darran Hunt (darran [at] hunt dot net dot nz)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host benchmark for the WiFly receive and parsing paths.
+ *
+ * A canned module transcript gets begin() through command mode, then a
+ * large HTTP response is replayed through read(), read(buf, size),
+ * match_P() and multiMatch_P() to measure bytes per second. The last
+ * scan watches for a dozen tokens at once.
+ */
+
+#include <stdio.h>
+#include <string>
+
+#include <WiFlyHQ.h>
+
+#include "ScriptStream.h"
+#include "SimClock.h"
+
+/* begin() sets up the module in one command mode session */
+static const char startup[] =
+    "CMD\r\n"
+    "<2.32> \r\n"
+    "AOK\r\n<2.32> AOK\r\n<2.32> AOK\r\n<2.32> "
+    "8111\r\n<2.32> "
+    "DHCP=ON\r\n<2.32> "
+    "Replace=0x24\r\n<2.32> "
+    "EXIT\r\n";
+
+static const char httpResponse[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Mon, 11 Mar 2013 10:24:31 GMT\r\n"
+    "Server: Apache/2.2.22 (Ubuntu)\r\n"
+    "Content-Type: text/html; charset=UTF-8\r\n"
+    "Content-Length: 175\r\n"
+    "\r\n"
+    "<html><head><title>WiFlyHQ</title></head>\r\n"
+    "<body><p>Status: *ok* temperature=21.5 humidity=48 "
+    "pressure=1013 light=743</p></body></html>\r\n";
+
+/* Response tokens a sketch might watch for; only the last is in the payload */
+static const char tok_err[] PROGMEM = "ERR: ";
+static const char tok_failed[] PROGMEM = "FAILED";
+static const char tok_clos[] PROGMEM = "*CLOS*";
+static const char tok_404[] PROGMEM = "HTTP/1.1 404";
+static const char tok_500[] PROGMEM = "HTTP/1.1 500";
+static const char tok_location[] PROGMEM = "Location: ";
+static const char tok_cookie[] PROGMEM = "Set-Cookie: ";
+static const char tok_chunked[] PROGMEM = "Transfer-Encoding: ";
+static const char tok_close[] PROGMEM = "Connection: close";
+static const char tok_error[] PROGMEM = "<error>";
+static const char tok_hum[] PROGMEM = "humidity=-";
+static const char tok_end[] PROGMEM = "</html>";
+
+static const char *tokens[] = {
+    tok_err, tok_failed, tok_clos, tok_404, tok_500, tok_location,
+    tok_cookie, tok_chunked, tok_close, tok_error, tok_hum, tok_end
+};
+
+static double seconds(unsigned long startUs)
+{
+    return (micros() - startUs) / 1000000.0;
+}
+
+static void report(const char *name, size_t bytes, double secs)
+{
+    printf("%-20s %10zu bytes %8.3f s %12.0f bytes/s\n",
+           name, bytes, secs, secs > 0 ? bytes / secs : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    ScriptStream serial;
+    SimClock sim;
+    WiFly wifly;
+    int repeat = 20000;
+
+    if (argc > 1) {
+        repeat = atoi(argv[1]);
+    }
+
+    /* command mode guard times and timeouts run in simulated time */
+    wifly.setClock(&sim);
+
+    serial.load(startup);
+    if (!wifly.begin(&serial)) {
+        fprintf(stderr, "begin failed\n");
+        return 1;
+    }
+
+    std::string payload;
+    for (int ind=0; ind<repeat; ind++) {
+        payload += httpResponse;
+    }
+
+    /* byte at a time read() */
+    serial.load(payload);
+    size_t count = 0;
+    unsigned long start = micros();
+    while (wifly.available() > 0) {
+        if (wifly.read() >= 0) {
+            count++;
+        }
+    }
+    report("read()", count, seconds(start));
+    if (count != payload.size()) {
+        fprintf(stderr, "read: expected %zu bytes, got %zu\n", payload.size(), count);
+        return 1;
+    }
+
+    /* block read() */
+    serial.load(payload);
+    count = 0;
+    start = micros();
+    int len;
+    uint8_t buf[256];
+    while ((len = wifly.read(buf, sizeof(buf))) > 0) {
+        count += len;
+    }
+    report("read(buf, size)", count, seconds(start));
+    if (count != payload.size()) {
+        fprintf(stderr, "read(buf): expected %zu bytes, got %zu\n", payload.size(), count);
+        return 1;
+    }
+
+    /* single token scan */
+    serial.load(payload);
+    int found = 0;
+    start = micros();
+    while (wifly.match_P(F("light="), 10)) {
+        found++;
+    }
+    report("match_P()", payload.size(), seconds(start));
+    if (found != repeat) {
+        fprintf(stderr, "match_P: expected %d matches, got %d\n", repeat, found);
+        return 1;
+    }
+
+    /* multi token scan */
+    serial.load(payload);
+    found = 0;
+    start = micros();
+    while (wifly.multiMatch_P(10, 4, F("humidity="), F("pressure="), F("light="), F("</html>")) >= 0) {
+        found++;
+    }
+    report("multiMatch_P()", payload.size(), seconds(start));
+    if (found != repeat * 4) {
+        fprintf(stderr, "multiMatch_P: expected %d matches, got %d\n", repeat * 4, found);
+        return 1;
+    }
+
+    /* a dozen tokens, one present */
+    serial.load(payload);
+    found = 0;
+    start = micros();
+    while (wifly.multiMatch_P(tokens, sizeof(tokens)/sizeof(tokens[0]), 10) >= 0) {
+        found++;
+    }
+    report("multiMatch_P() x12", payload.size(), seconds(start));
+    if (found != repeat) {
+        fprintf(stderr, "multiMatch_P x12: expected %d matches, got %d\n", repeat, found);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,610 @@
+/*-
+ * Copyright (c) 2012,2013 Darran Hunt (darran [at] hunt dot net dot nz)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host benchmark of a full module session against the RN-XV emulator.
+ *
+ * Reports the time taken by begin(), option reads and writes, join,
+ * reading a dozen settings with and without a configuration snapshot,
+ * open and close, the number of serial writes used to send a body with
+ * and without write buffering, and the sustained TCP receive rate at a
+ * paced baud rate. Runs in simulated time unless -r is given.
+ *
+ * usage: bench_session [-r] [baud]
+ */
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <WiFlyHQ.h>
+#include <RNXVEmulator.h>
+#include <SimClock.h>
+
+static WFClock *clock;
+static unsigned long lapStart;
+
+static void lap()
+{
+    lapStart = clock->millis();
+}
+
+static bool failed;
+
+static void report(const char *name, bool ok)
+{
+    printf("%-24s %6lu ms %s\n", name, clock->millis() - lapStart, ok ? "" : "FAILED");
+    failed = failed || !ok;
+}
+
+/* Stands in for the EEPROM a sketch would keep the fingerprint in */
+static uint32_t storedFingerprint;
+
+static uint32_t fingerprintStore(boolean save, uint32_t fingerprint)
+{
+    if (save) {
+        storedFingerprint = fingerprint;
+    }
+    return storedFingerprint;
+}
+
+/**
+ * Read the settings a sketch typically prints at startup.
+ * @returns true if they have the expected values
+ */
+static bool diagnostics(WiFly &wifly)
+{
+    char buf[32];
+    bool ok = true;
+
+    ok = ok && strcmp(wifly.getIP(buf, sizeof(buf)), "192.168.1.50") == 0;
+    ok = ok && strcmp(wifly.getNetmask(buf, sizeof(buf)), "255.255.255.0") == 0;
+    ok = ok && strcmp(wifly.getGateway(buf, sizeof(buf)), "192.168.1.1") == 0;
+    ok = ok && wifly.getDNS(buf, sizeof(buf)) != NULL;
+    ok = ok && strcmp(wifly.getMAC(buf, sizeof(buf)), "00:06:66:71:b4:17") == 0;
+    ok = ok && strcmp(wifly.getSSID(buf, sizeof(buf)), "roving1") == 0;
+    ok = ok && strcmp(wifly.getDeviceID(buf, sizeof(buf)), "bench") == 0;
+    ok = ok && wifly.getPort() == 2000;
+    ok = ok && wifly.getDHCPMode() == 1;
+    ok = ok && wifly.getProtocol() == WIFLY_PROTOCOL_TCP;
+    ok = ok && wifly.getBaud() == 9600;
+    ok = ok && wifly.getFlushSize() == 64;
+
+    return ok;
+}
+
+/* Ping the collector once its address is known */
+static char collectorIP[16];
+static WFCommand pingCmd;
+
+static void lookupDone(WFCommand *cmd, void *context)
+{
+    if (cmd->status == WIFLY_CMD_OK) {
+        ((WiFly *)context)->pingAsync(&pingCmd, collectorIP);
+    }
+}
+
+/* An SNMP get-request for ifInOctets.2, split into fixed and variable parts */
+static const uint8_t snmpHeader[] PROGMEM = {
+    0x30, 0x29, 0x02, 0x01, 0x00, 0x04, 0x06, 'p', 'u', 'b', 'l', 'i', 'c',
+    0xa0, 0x1c, 0x02, 0x04
+};
+static const uint8_t snmpOid[] PROGMEM = {
+    0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x30, 0x0e, 0x30, 0x0c, 0x06, 0x08,
+    0x2b, 0x06, 0x01, 0x02, 0x01, 0x02, 0x02, 0x01, 0x0a, 0x02, 0x05, 0x00
+};
+
+/* Records that span more than one packet, given the size of each */
+static int crossings(const std::vector<int> &records, const std::vector<uint32_t> &packets)
+{
+    size_t pkt = 0;
+    uint32_t end = packets.empty() ? 0 : packets[0];
+    uint32_t start = 0;
+    int count = 0;
+
+    for (size_t ind=0; ind<records.size(); ind++) {
+        while ((start >= end) && (++pkt < packets.size())) {
+            end += packets[pkt];
+        }
+        if (start + records[ind] > end) {
+            count++;
+        }
+        start += records[ind];
+    }
+    return count;
+}
+
+/**
+ * Send a form body a field at a time with print(), as a sketch would,
+ * and report how many serial writes it took.
+ */
+static bool sendBody(WiFly &wifly, RNXVEmulator &module, const char *name, int lines)
+{
+    uint32_t calls = module.writeCalls();
+    size_t count = 0;
+    bool ok;
+
+    module.clearSent();
+    lap();
+    for (int line=0; line<lines; line++) {
+        count += wifly.print(F("temperature="));
+        count += wifly.print(line);
+        count += wifly.println(F("&humidity=48&pressure=1013&light=743"));
+    }
+    wifly.flush();
+    ok = (module.sent().size() == count);
+    report(name, ok);
+    printf("%-24s %6lu serial writes for %lu bytes\n", "",
+           (unsigned long)(module.writeCalls() - calls), (unsigned long)count);
+
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    RNXVEmulator module;
+    SimClock sim;
+    WiFly wifly;
+    char buf[32];
+    uint32_t baud = 230400;
+    size_t size = 32768;
+    bool realTime = false;
+    bool ok;
+
+    for (int arg=1; arg<argc; arg++) {
+        if (strcmp(argv[arg], "-r") == 0) {
+            realTime = true;
+        } else {
+            baud = atol(argv[arg]);
+        }
+    }
+
+    if (!realTime) {
+        wifly.setClock(&sim);
+        module.setClock(&sim);
+        sim.attach(&module);
+    }
+    clock = wifly.getClock();
+    unsigned long wallStart = micros();
+
+    module.setBaud(baud);
+    module.setLatency(200);
+    module.setJoinTime(200, 150);
+    module.addHost("collector.example.com", "192.168.1.20");
+    /* two names with the same FNV-1a hash */
+    module.addHost("h84337.example.com", "192.168.1.30");
+    module.addHost("h1340180.example.com", "192.168.1.31");
+    module.setLookupTime(150);
+
+    lap();
+    ok = wifly.begin(&module);
+    report("begin()", ok);
+    if (!ok) {
+        return 1;
+    }
+
+    /* restart with the setup saved once, then skipped */
+    wifly.setFingerprintStore(fingerprintStore);
+    for (int pass=0; pass<2; pass++) {
+        uint32_t commands = module.commandCount();
+        lap();
+        ok = wifly.begin(&module);
+        report(pass ? "begin() fingerprinted" : "begin() saving setup", ok);
+        printf("%-24s %6lu commands\n", "", (unsigned long)(module.commandCount() - commands));
+    }
+
+    /* a different WiFly fitted in its place is set up again */
+    uint32_t saves = module.saveCount();
+    module.setMAC("00:06:66:71:b4:18");
+    lap();
+    ok = wifly.begin(&module) && (module.saveCount() - saves == 1);
+    report("begin() other WiFly", ok);
+    module.setMAC("00:06:66:71:b4:17");
+
+    lap();
+    ok = strcmp(wifly.getSSID(buf, sizeof(buf)), "roving1") == 0;
+    report("getSSID()", ok);
+
+    lap();
+    ok = wifly.setDeviceID("bench");
+    report("setDeviceID()", ok);
+
+    lap();
+    ok = wifly.enableDataTrigger(10, 0, 64);
+    report("enableDataTrigger()", ok);
+
+    lap();
+    ok = wifly.join();
+    report("join()", ok);
+
+    /* a sketch loop checking the link each time round, uncached then cached */
+    for (int pass=0; pass<2; pass++) {
+        uint32_t commands = module.commandCount();
+        wifly.setStatusTTL(pass ? WIFLY_STATUS_TTL : 0);
+        lap();
+        ok = true;
+        for (int ind=0; ind<20; ind++) {
+            ok = wifly.isAssociated() && ok;
+            clock->delay(50);
+        }
+        report(pass ? "isAssociated() cached" : "isAssociated() x20", ok);
+        printf("%-24s %6lu commands\n", "", (unsigned long)(module.commandCount() - commands));
+    }
+
+    /* rejoin without blocking, then a join that fails */
+    WFJoin join;
+    for (int pass=0; pass<2; pass++) {
+        module.setJoinFail(pass == 1);
+        lap();
+        wifly.joinAsync(&join);
+        while (wifly.poll()) {
+            clock->idle();
+        }
+        ok = (join.phase == (pass ? WIFLY_JOIN_FAILED : WIFLY_JOIN_BOUND));
+        report(pass ? "joinAsync() failing" : "joinAsync()", ok);
+        printf("%-24s %6u ms joining, %u associated, %u bound, reason %u\n", "",
+               join.at[WIFLY_JOIN_JOINING], join.at[WIFLY_JOIN_ASSOCIATED],
+               join.at[WIFLY_JOIN_BOUND], join.reason);
+    }
+    module.setJoinFail(false);
+
+    /* with a static address the join is done once associated */
+    ok = wifly.setDHCP(WIFLY_DHCP_MODE_OFF);
+    lap();
+    ok = wifly.join() && ok;
+    report("join() static IP", ok);
+    lap();
+    wifly.joinAsync(&join);
+    while (wifly.poll()) {
+        clock->idle();
+    }
+    ok = (join.phase == WIFLY_JOIN_ASSOCIATED) && (join.reason == WIFLY_JOIN_OK);
+    report("joinAsync() static IP", ok);
+    wifly.setDHCP(WIFLY_DHCP_MODE_ON);
+    wifly.join();
+
+    /* reconnect after the WiFly drops off the network, with a realistic scan and DHCP */
+    WFLink link;
+    module.setScanTime(2000);
+    module.setJoinTime(200, 1500);
+    wifly.saveLink(&link);
+    for (int pass=0; pass<3; pass++) {
+        static const char *names[] = { "join() full scan", "reconnect()", "reconnect() AP moved" };
+        module.setAPChannel(pass == 2 ? 11 : 6);
+        module.setAssociated(false);
+        lap();
+        ok = pass ? wifly.reconnect(&link) : wifly.join((uint16_t)20000);
+        report(names[pass], ok);
+    }
+    ok = link.valid && (link.channel == 11);
+    printf("%-24s %6u channel saved, %s %s\n", "", link.channel, link.ip, ok ? "" : "FAILED");
+    failed = failed || !ok;
+
+    /* a channel fixed by the sketch is kept */
+    wifly.setChannel(11);
+    module.setAssociated(false);
+    lap();
+    ok = wifly.reconnect(&link) && (wifly.getChannel() == 11);
+    report("reconnect() fixed channel", ok);
+    wifly.setChannel(0);
+    module.setScanTime(0);
+    module.setJoinTime(200, 150);
+
+    lap();
+    ok = wifly.getIP(buf, sizeof(buf)) && strcmp(buf, "192.168.1.50") == 0;
+    report("getIP()", ok);
+
+    /* a periodic status read, after the line has been idle */
+    clock->delay(1000);
+    lap();
+    ok = wifly.getRSSI() != 0;
+    report("getRSSI() when idle", ok);
+
+    /* lookup and ping without blocking, counting the loop iterations left for other work */
+    WFCommand lookupCmd;
+    unsigned long polls = 0;
+    lap();
+    wifly.lookupAsync(&lookupCmd, "collector.example.com", collectorIP, sizeof(collectorIP));
+    lookupCmd.done = lookupDone;
+    lookupCmd.context = &wifly;
+    while (wifly.poll()) {
+        polls++;
+        clock->idle();
+    }
+    ok = (lookupCmd.status == WIFLY_CMD_OK) && (pingCmd.status == WIFLY_CMD_OK) &&
+        (strcmp(collectorIP, "192.168.1.20") == 0);
+    report("lookup, ping async", ok);
+    printf("%-24s %6lu polls while waiting\n", "", polls);
+
+    lap();
+    ok = diagnostics(wifly);
+    report("diagnostics", ok);
+
+    WFConfig config;
+    wifly.setConfigCache(&config);
+    lap();
+    ok = diagnostics(wifly);
+    report("diagnostics cached", ok);
+    printf("%-24s %6u bytes of %u used\n", "", config.used, (unsigned)sizeof(config.pool));
+
+    WFProfile profile;
+    memset(&profile, 0, sizeof(profile));
+    profile.fields = WIFLY_PROFILE_SSID | WIFLY_PROFILE_PASSPHRASE | WIFLY_PROFILE_AUTH |
+        WIFLY_PROFILE_DHCP | WIFLY_PROFILE_PROTOCOL | WIFLY_PROFILE_PORT |
+        WIFLY_PROFILE_FLUSH_TIMEOUT | WIFLY_PROFILE_FLUSH_SIZE;
+    profile.ssid = "roving1";
+    profile.passphrase = "bench-passphrase";
+    profile.auth = WIFLY_AUTH_WPA2_PSK;
+    profile.dhcpMode = WIFLY_DHCP_MODE_ON;
+    profile.protocol = WIFLY_PROTOCOL_TCP;
+    profile.port = 2000;
+    profile.flushTimeout = 20;
+    profile.flushSize = 128;
+
+    uint16_t changed;
+    for (int pass=0; pass<2; pass++) {
+        uint32_t saves = module.saveCount();
+        lap();
+        ok = wifly.applyProfile(&profile, &changed);
+        saves = module.saveCount() - saves;
+        /* nothing changed the second time, so nothing is written to flash */
+        report(pass ? "applyProfile() again" : "applyProfile()", ok && (!pass || (!changed && !saves)));
+        printf("%-24s %#6x changed, %lu saves\n", "", changed, (unsigned long)saves);
+    }
+
+    /* only the passphrase differs, and it can't be read back */
+    profile.passphrase = "bench-passphrase-2";
+    lap();
+    ok = wifly.applyProfile(&profile, &changed) && (changed == WIFLY_PROFILE_PASSPHRASE) &&
+        (strcmp(module.getOption("wlan phrase"), profile.passphrase) == 0);
+    report("applyProfile() phrase", ok);
+    wifly.setConfigCache(NULL);
+
+    /* fan out readings to two collectors, alternating */
+    static const char *collectors[] = { "192.168.1.20", "192.168.1.21" };
+    const int packets = 10;
+    lap();
+    ok = true;
+    for (int ind=0; ind<packets; ind++) {
+        ok = wifly.sendto("t=21.5 h=48", collectors[ind & 1], 9000) && ok;
+    }
+    report("sendto() x2 hosts", ok);
+    WFUdpSession udp[2];
+    ok = wifly.udpBegin(&udp[0], collectors[0], 9000) && wifly.udpBegin(&udp[1], collectors[1], 9000);
+    lap();
+    for (int ind=0; ind<packets; ind++) {
+        ok = wifly.udpSend(&udp[ind & 1], "t=21.5 h=48") && ok;
+    }
+    report("udpSend() x2 hosts", ok);
+    lap();
+    for (int ind=0; ind<packets; ind++) {
+        ok = wifly.udpSend(&udp[0], "t=21.5 h=48") && ok;
+    }
+    report("udpSend() x1 host", ok);
+    printf("%-24s %6lu packets, %u switches, %lu packets/s\n", "", (unsigned long)udp[0].packets,
+           udp[0].switches, (unsigned long)wifly.udpRate(&udp[0]));
+
+    /* build each request from its parts, piece by piece and then gathered */
+    uint8_t requestId[4] = { 0x12, 0x34, 0x00, 0x00 };
+    for (int pass=0; pass<2; pass++) {
+        uint32_t calls = module.writeCalls();
+        lap();
+        for (int ind=0; ind<packets; ind++) {
+            requestId[3] = ind;
+            if (pass == 0) {
+                for (size_t pos=0; pos<sizeof(snmpHeader); pos++) {
+                    wifly.write(pgm_read_byte(&snmpHeader[pos]));
+                }
+                wifly.write(requestId, sizeof(requestId));
+                for (size_t pos=0; pos<sizeof(snmpOid); pos++) {
+                    wifly.write(pgm_read_byte(&snmpOid[pos]));
+                }
+            } else {
+                WFSegment segs[] = {
+                    { snmpHeader, sizeof(snmpHeader), true },
+                    { requestId, sizeof(requestId), false },
+                    { snmpOid, sizeof(snmpOid), true },
+                };
+                wifly.udpSend(&udp[0], segs, 3);
+            }
+        }
+        report(pass ? "udpSend() segments" : "write() pieces", true);
+        printf("%-24s %6lu serial writes for %d packets\n", "",
+               (unsigned long)(module.writeCalls() - calls), packets);
+    }
+
+    /* without host restore, sendto() after a session must still set its host */
+    wifly.disableHostRestore();
+    ok = wifly.sendto("t=21.5 h=48", collectors[1], 9000);
+    ok = wifly.udpSend(&udp[0], "t=21.5 h=48") && ok;
+    lap();
+    ok = wifly.sendto("t=21.5 h=48", collectors[1], 9000) && ok;
+    ok = ok && (strcmp(module.getOption("ip host"), collectors[1]) == 0);
+    report("sendto() after udpSend()", ok);
+    wifly.enableHostRestore();
+
+    /* a collector reconnecting by name, the second lookup comes from the DNS cache */
+    for (int pass=0; pass<2; pass++) {
+        lap();
+        ok = wifly.open("collector.example.com", 80);
+        report(pass ? "open() by name, cached" : "open() by name", ok);
+        wifly.close();
+    }
+    printf("%-24s %6u DNS hits, %u misses\n", "", wifly.getDnsHits(), wifly.getDnsMisses());
+
+    /* a name whose hash matches a cached one is still looked up */
+    char first[16], second[16];
+    lap();
+    ok = wifly.getHostByName("h84337.example.com", first, sizeof(first)) &&
+        wifly.getHostByName("h1340180.example.com", second, sizeof(second)) &&
+        (strcmp(first, "192.168.1.30") == 0) && (strcmp(second, "192.168.1.31") == 0);
+    report("lookup hash collision", ok);
+
+    lap();
+    ok = wifly.open("192.168.1.20", 80);
+    report("open()", ok);
+
+    /* log records of varying size, packed by the WiFly and then framed */
+    static const char *framings[] = { "write() records", "frameWrite() split", "frameWrite() pad" };
+    std::vector<int> records;
+    for (int ind=0; ind<30; ind++) {
+        records.push_back(10 + (ind * 7) % 40);
+    }
+    for (int pass=0; pass<3; pass++) {
+        WFFrame frame;
+        uint8_t record[64];
+        unsigned long polls = 0;
+        clock->delay(20);
+        module.clearPackets();
+        ok = (pass == 0) || wifly.frameBegin(&frame, pass == 1 ? WIFLY_FRAME_SPLIT : WIFLY_FRAME_PAD, ' ');
+        lap();
+        for (size_t ind=0; ind<records.size(); ind++) {
+            memset(record, 'a' + ind, records[ind]);
+            if (pass == 0) {
+                wifly.write(record, records[ind]);
+            } else {
+                /* split mode doesn't block while the flush timer runs */
+                while (wifly.frameWrite(&frame, record, records[ind]) == 0) {
+                    polls++;
+                    clock->idle();
+                }
+            }
+        }
+        report(framings[pass], ok);
+        clock->delay(20);
+        const std::vector<uint32_t> &sent = module.packets();
+        if (pass == 0) {
+            printf("%-24s %6zu packets, %d records crossed\n", "", sent.size(), crossings(records, sent));
+        } else {
+            printf("%-24s %6zu packets, %lu records crossed, %lu padding, %lu polls while waiting\n", "",
+                   sent.size(), (unsigned long)frame.crossed, (unsigned long)frame.padding, polls);
+        }
+    }
+
+    sendBody(wifly, module, "send", 100);
+    wifly.enableWriteBuffering();
+    sendBody(wifly, module, "send buffered", 100);
+
+    /* a request shorter than the buffer, then a wait for the reply */
+    static const char request[] = "GET / HTTP/1.0\r\n\r\n";
+    module.clearSent();
+    lap();
+    wifly.print(request);
+    while ((module.sent().size() < strlen(request)) && (clock->millis() - lapStart < 1000)) {
+        wifly.available();
+        clock->idle();
+    }
+    ok = (module.sent() == request);
+    report("request, available()", ok);
+    wifly.disableWriteBuffering();
+
+    std::string payload;
+    while (payload.size() < size) {
+        payload += "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ\r\n";
+    }
+    payload.resize(size);
+    module.remoteSend(payload.c_str());
+    module.remoteClose();
+
+    lap();
+    size_t count = 0;
+    int avail;
+    while ((avail = wifly.available()) >= 0) {
+        if (avail > 0 && wifly.read() >= 0) {
+            count++;
+        } else if (avail == 0) {
+            clock->idle();
+        }
+    }
+    unsigned long msecs = clock->millis() - lapStart;
+    ok = (count == payload.size());
+    report("receive", ok);
+    printf("%-24s %6lu bytes/s at %lu baud\n", "", msecs ? count * 1000 / msecs : 0, (unsigned long)baud);
+
+    lap();
+    ok = !wifly.isConnected();
+    report("close detected", ok);
+
+    /* the sketch restarts while the WiFly holds a connection, the peer sees nothing */
+    ok = wifly.open("192.168.1.20", 80);
+    module.clearSent();
+    clock->delay(500);    /* the sketch restarting */
+    {
+        WiFly restarted;
+        restarted.setClock(clock);
+        lap();
+        ok = ok && restarted.begin(&module) && module.isConnected() && module.sent().empty();
+        report("begin() while connected", ok);
+    }
+    wifly.close();
+
+    /* reboot after a configuration change, then a timed sleep */
+    lap();
+    ok = wifly.reboot();
+    report("reboot()", ok);
+    printf("%-24s %6lu ms booting\n", "", (unsigned long)wifly.getBootTime());
+    lap();
+    ok = wifly.sleep(3);
+    report("sleep(3)", ok);
+    lap();
+    ok = wifly.getRSSI() == 0 && clock->millis() - lapStart < 100;
+    report("getRSSI() while asleep", ok);
+    lap();
+    ok = wifly.pingAsync(&pingCmd, "192.168.1.20");
+    while (wifly.poll()) {
+        clock->idle();
+    }
+    ok = ok && (pingCmd.status == WIFLY_CMD_TIMEOUT) && (clock->millis() - lapStart < 100);
+    report("pingAsync() while asleep", ok);
+    lap();
+    while (!wifly.wakeComplete()) {
+        clock->idle();
+    }
+    ok = wifly.getBootTime() < 1000;
+    report("sleep(3) until awake", ok);
+    printf("%-24s %6lu ms booting\n", "", (unsigned long)wifly.getBootTime());
+    lap();
+    ok = strcmp(wifly.getIP(buf, sizeof(buf)), "0.0.0.0") != 0;
+    report("getIP() after wake", ok);
+
+    /* sleep on the wake timer already set, reading data while the *READY* arrives */
+    lap();
+    ok = wifly.sleep();
+    while (ok && (clock->millis() - lapStart < 5000)) {
+        if (wifly.available() > 0) {
+            wifly.read();
+        } else {
+            clock->idle();
+        }
+    }
+    ok = ok && wifly.wakeComplete() && (strcmp(wifly.getIP(buf, sizeof(buf)), "192.168.1.50") == 0);
+    report("sleep(), read(), getIP()", ok);
+
+    printf("%-24s %6lu\n", "command mode entries", (unsigned long)module.commandModeEntries());
+    printf("%-24s %6lu\n", "commands", (unsigned long)module.commandCount());
+    printf("%-24s %6lu us wall clock\n", realTime ? "real time" : "simulated", micros() - wallStart);
+
+    return failed ? 1 : 0;
+}
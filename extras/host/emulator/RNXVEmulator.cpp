@@ -0,0 +1,951 @@
+/*-
+ * Copyright (c) 2012,2013 Darran Hunt (darran [at] hunt dot net dot nz)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file RNXVEmulator.cpp
+ *
+ * @brief Emulation of the RN-XV 2.32 command interpreter and data mode.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "RNXVEmulator.h"
+
+/* Option categories and parameter names, in the order the firmware
+ * resolves abbreviations ("set u m 1" is "set uart mode 1").
+ */
+static const struct {
+    const char *category;
+    const char *params[14];
+} optionNames[] = {
+    { "adhoc",     { "beacon", "probe", "reboot", NULL } },
+    { "broadcast", { "address", "interval", "port", NULL } },
+    { "comm",      { "$", "close", "open", "remote", "idle", "match", "size", "time", NULL } },
+    { "dns",       { "address", "backup", "name", NULL } },
+    { "ftp",       { "addr", "dir", "filename", "mode", "remote", "time", "user", "pass", NULL } },
+    { "ip",        { "address", "backup", "dhcp", "flags", "gateway", "host", "localport",
+                     "netmask", "protocol", "remote", "tcp-mode", NULL } },
+    { "opt",       { "jointmr", "format", "replace", "deviceid", "password", NULL } },
+    { "sys",       { "autoconn", "autosleep", "iofunc", "mask", "printlvl", "output",
+                     "sleep", "trigger", "value", "wake", NULL } },
+    { "time",      { "address", "port", "enable", "raw", "zone", NULL } },
+    { "uart",      { "baud", "instant", "flow", "mode", "raw", "tx", NULL } },
+    { "wlan",      { "auth", "channel", "ext_antenna", "join", "hide", "key", "linkmon",
+                     "mask", "phrase", "rate", "ssid", "tx", "window", NULL } },
+};
+
+#define NUM_CATEGORIES (sizeof(optionNames)/sizeof(optionNames[0]))
+
+static bool isPrefix(const std::string &abbrev, const char *name)
+{
+    return !abbrev.empty() && strncmp(abbrev.c_str(), name, abbrev.size()) == 0;
+}
+
+/* Split the first word off a command line */
+static std::string nextWord(std::string &args)
+{
+    size_t start = args.find_first_not_of(' ');
+    if (start == std::string::npos) {
+        args.clear();
+        return "";
+    }
+    size_t end = args.find(' ', start);
+    std::string word = args.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    args = (end == std::string::npos) ? "" : args.substr(end + 1);
+    return word;
+}
+
+static uint32_t parseNum(const std::string &value)
+{
+    return strtoul(value.c_str(), NULL, (value.compare(0, 2, "0x") == 0) ? 16 : 10);
+}
+
+static std::string format(const char *fmt, ...)
+{
+    char buf[128];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    return buf;
+}
+
+RNXVEmulator::RNXVEmulator()
+{
+    clock = NULL;
+    lastMicros = 0;
+    microsHigh = 0;
+    outEnd = 0;
+    byteUs = 0;
+    latencyUs = 0;
+    guardMs = 250;
+    assocMs = 1000;
+    dhcpMs = 300;
+    scanMs = 0;
+    connectMs = 50;
+    lookupMs = 0;
+    bootMs = 1000;
+
+    mode = MODE_DATA;
+    dollars = 0;
+    lastRx = 0;
+    bootUntil = 0;
+    bootedAt = now();
+
+    defaults(config);
+    stored = config;
+    version = "2.32";
+    mac = "00:06:66:71:b4:17";
+
+    associated = false;
+    channel = 0;
+    apChannel = 6;
+    lease = false;
+    tcpConnected = false;
+    joinFail = false;
+    openFail = false;
+    packetLen = 0;
+    packetLast = 0;
+
+    commands = 0;
+    cmdEntries = 0;
+    saves = 0;
+    txBytes = 0;
+    rxBytes = 0;
+    writes = 0;
+}
+
+/** Factory default configuration */
+void RNXVEmulator::defaults(Config &cfg)
+{
+    cfg.clear();
+    cfg["adhoc beacon"] = "100";
+    cfg["adhoc probe"] = "5";
+    cfg["adhoc reboot"] = "0";
+    cfg["broadcast address"] = "255.255.255.255";
+    cfg["broadcast interval"] = "0x7";
+    cfg["broadcast port"] = "55555";
+    cfg["comm $"] = "$";
+    cfg["comm close"] = "*CLOS*";
+    cfg["comm open"] = "*OPEN*";
+    cfg["comm remote"] = "*HELLO*";
+    cfg["comm idle"] = "0";
+    cfg["comm match"] = "0";
+    cfg["comm size"] = "64";
+    cfg["comm time"] = "10";
+    cfg["dns address"] = "0.0.0.0";
+    cfg["dns backup"] = "rn.microchip.com";
+    cfg["dns name"] = "dns1";
+    cfg["ftp addr"] = "0.0.0.0";
+    cfg["ftp dir"] = "public";
+    cfg["ftp filename"] = "wifly-GSX.img";
+    cfg["ftp mode"] = "0x0";
+    cfg["ftp pass"] = "Pass123";
+    cfg["ftp remote"] = "21";
+    cfg["ftp time"] = "40";
+    cfg["ftp user"] = "roving";
+    cfg["ip address"] = "0.0.0.0";
+    cfg["ip backup"] = "0.0.0.0";
+    cfg["ip dhcp"] = "1";
+    cfg["ip flags"] = "0x7";
+    cfg["ip gateway"] = "0.0.0.0";
+    cfg["ip host"] = "0.0.0.0";
+    cfg["ip localport"] = "2000";
+    cfg["ip netmask"] = "255.255.255.0";
+    cfg["ip protocol"] = "2";
+    cfg["ip remote"] = "2000";
+    cfg["opt deviceid"] = "WiFly-GSX";
+    cfg["opt format"] = "0";
+    cfg["opt jointmr"] = "1000";
+    cfg["opt password"] = "";
+    cfg["opt replace"] = "$";
+    cfg["sys printlvl"] = "0x1";
+    cfg["sys sleep"] = "0";
+    cfg["sys wake"] = "0";
+    cfg["sys iofunc"] = "0x0";
+    cfg["time address"] = "64.90.182.55";
+    cfg["time enable"] = "0";
+    cfg["time port"] = "123";
+    cfg["time zone"] = "7";
+    cfg["uart baud"] = "9600";
+    cfg["uart flow"] = "0";
+    cfg["uart mode"] = "0";
+    cfg["wlan auth"] = "4";
+    cfg["wlan channel"] = "0";
+    cfg["wlan hide"] = "0";
+    cfg["wlan join"] = "1";
+    cfg["wlan key"] = "";
+    cfg["wlan linkmon"] = "0";
+    cfg["wlan phrase"] = "rubygirl";
+    cfg["wlan rate"] = "12";
+    cfg["wlan ssid"] = "roving1";
+    cfg["wlan tx"] = "0";
+}
+
+/** Current time in microseconds, extended to 64 bits */
+uint64_t RNXVEmulator::now()
+{
+    uint32_t t = clock ? clock->micros() : micros();
+
+    if (t < lastMicros) {
+        microsHigh += 1ULL << 32;
+    }
+    lastMicros = t;
+    return microsHigh | t;
+}
+
+void RNXVEmulator::setClock(WFClock *clk)
+{
+    clock = clk;
+    lastMicros = 0;
+    microsHigh = 0;
+    outEnd = 0;
+    bootedAt = now();
+}
+
+uint32_t RNXVEmulator::usecsToNextEvent()
+{
+    uint64_t t = now();
+    uint64_t next;
+
+    if (out.empty()) {
+        next = (mode == MODE_BOOT || mode == MODE_SLEEP) ? bootUntil : (uint64_t)-1;
+    } else {
+        const Chunk &chunk = out.front();
+        next = chunk.start + (uint64_t)(chunk.pos + 1) * chunk.byteUs;
+    }
+    if (next <= t) {
+        return 0;
+    }
+    return (next - t > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (uint32_t)(next - t);
+}
+
+void RNXVEmulator::setBaud(uint32_t baud)
+{
+    /* 8N1 is ten bits per byte */
+    byteUs = baud ? 10000000UL / baud : 0;
+}
+
+void RNXVEmulator::setLatency(uint32_t usecs) { latencyUs = usecs; }
+void RNXVEmulator::setGuardTime(uint16_t msecs) { guardMs = msecs; }
+void RNXVEmulator::setConnectTime(uint32_t msecs) { connectMs = msecs; }
+void RNXVEmulator::setLookupTime(uint32_t msecs) { lookupMs = msecs; }
+void RNXVEmulator::setBootTime(uint32_t msecs) { bootMs = msecs; }
+void RNXVEmulator::setVersion(const char *ver) { version = ver; }
+void RNXVEmulator::setMAC(const char *addr) { mac = addr; }
+void RNXVEmulator::setJoinFail(bool fail) { joinFail = fail; }
+void RNXVEmulator::setAPChannel(uint8_t chan) { apChannel = chan; }
+void RNXVEmulator::setScanTime(uint32_t msecs) { scanMs = msecs; }
+void RNXVEmulator::setOpenFail(bool fail) { openFail = fail; }
+
+void RNXVEmulator::setJoinTime(uint32_t assocMsecs, uint32_t dhcpMsecs)
+{
+    assocMs = assocMsecs;
+    dhcpMs = dhcpMsecs;
+}
+
+void RNXVEmulator::setAssociated(bool assoc, uint8_t chan)
+{
+    associated = assoc;
+    channel = assoc ? chan : 0;
+}
+
+void RNXVEmulator::setOption(const char *name, const char *value)
+{
+    config[name] = value;
+    stored[name] = value;
+}
+
+const char *RNXVEmulator::getOption(const char *name)
+{
+    Config::iterator it = config.find(name);
+    return it == config.end() ? NULL : it->second.c_str();
+}
+
+void RNXVEmulator::addHost(const char *name, const char *ip)
+{
+    hosts[name] = ip;
+}
+
+/** Queue a response, paced at the current baud rate */
+void RNXVEmulator::emit(const std::string &str, uint32_t delayUs)
+{
+    Chunk chunk;
+    uint64_t start = now() + latencyUs + delayUs;
+
+    if (str.empty()) {
+        return;
+    }
+    if (start < outEnd) {
+        start = outEnd;
+    }
+    chunk.start = start;
+    chunk.byteUs = byteUs;
+    chunk.data = str;
+    chunk.pos = 0;
+    out.push_back(chunk);
+    outEnd = start + (uint64_t)str.size() * byteUs;
+}
+
+void RNXVEmulator::emitPrompt()
+{
+    emit("<" + version + "> ");
+}
+
+int RNXVEmulator::available()
+{
+    uint64_t t = now();
+    size_t count = 0;
+
+    for (std::deque<Chunk>::iterator it = out.begin(); it != out.end(); ++it) {
+        size_t ready;
+        if (t < it->start) {
+            break;
+        }
+        if (it->byteUs == 0) {
+            ready = it->data.size();
+        } else {
+            ready = (t - it->start) / it->byteUs;
+            if (ready > it->data.size()) {
+                ready = it->data.size();
+            }
+        }
+        if (ready > it->pos) {
+            count += ready - it->pos;
+        }
+        if (ready < it->data.size()) {
+            break;
+        }
+    }
+    return count;
+}
+
+int RNXVEmulator::peek()
+{
+    if (available() <= 0) {
+        return -1;
+    }
+    return (uint8_t)out.front().data[out.front().pos];
+}
+
+int RNXVEmulator::read()
+{
+    if (available() <= 0) {
+        return -1;
+    }
+    Chunk &chunk = out.front();
+    uint8_t ch = chunk.data[chunk.pos++];
+    if (chunk.pos >= chunk.data.size()) {
+        out.pop_front();
+    }
+    txBytes++;
+    return ch;
+}
+
+void RNXVEmulator::flush()
+{
+}
+
+size_t RNXVEmulator::write(uint8_t byte)
+{
+    writes++;
+    rxBytes++;
+    input(byte);
+    return 1;
+}
+
+size_t RNXVEmulator::write(const uint8_t *buf, size_t size)
+{
+    writes++;
+    rxBytes += size;
+    for (size_t ind=0; ind<size; ind++) {
+        input(buf[ind]);
+    }
+    return size;
+}
+
+/** Handle a byte from the WiFly */
+void RNXVEmulator::input(uint8_t ch)
+{
+    uint64_t t = now();
+
+    switch (mode) {
+    case MODE_BOOT:
+    case MODE_SLEEP:
+        if (t < bootUntil) {
+            /* module is not listening yet */
+            lastRx = t;
+            return;
+        }
+        mode = MODE_DATA;
+        /* fall through */
+    case MODE_DATA:
+        if ((ch == '$') && ((dollars > 0) || (t - lastRx >= (uint64_t)guardMs * 1000))) {
+            if (++dollars == 3) {
+                dollars = 0;
+                mode = MODE_COMMAND;
+                line.clear();
+                cmdEntries++;
+                emit("CMD\r\n", guardMs * 1000);
+            }
+        } else {
+            for (; dollars > 0; dollars--) {
+                dataByte('$', t);
+            }
+            dataByte(ch, t);
+        }
+        break;
+
+    case MODE_COMMAND:
+        if ((optNum("uart mode") & 0x01) == 0) {
+            /* echo is on */
+            emit(ch == '\r' ? std::string("\r\n") : std::string(1, (char)ch));
+        }
+        if (ch == '\r') {
+            std::string cmd = line;
+            line.clear();
+            command(cmd);
+        } else if (ch != '\n') {
+            line += (char)ch;
+        }
+        break;
+    }
+    lastRx = t;
+}
+
+/**
+ * Data mode byte from the WiFly, destined for the network. Bytes are
+ * sent as a packet when comm size of them have been collected, when
+ * the comm match character arrives, or when comm time passes with no
+ * more.
+ */
+void RNXVEmulator::dataByte(uint8_t ch, uint64_t t)
+{
+    if (tcpConnected || (optNum("ip protocol") & 0x01)) {
+        uint32_t size = optNum("comm size");
+        uint32_t match = optNum("comm match");
+
+        packetTimer(t);
+        dataOut += (char)ch;
+        packetLen++;
+        packetLast = t;
+        if ((match && (ch == match)) || (size && (packetLen >= size))) {
+            packetSizes.push_back(packetLen);
+            packetLen = 0;
+        }
+    }
+}
+
+/** Send the collected bytes if the flush timer has run out */
+void RNXVEmulator::packetTimer(uint64_t t)
+{
+    uint32_t time = optNum("comm time");
+
+    if (packetLen && time && (t - packetLast > (uint64_t)time * 1000)) {
+        packetSizes.push_back(packetLen);
+        packetLen = 0;
+    }
+}
+
+const std::vector<uint32_t> &RNXVEmulator::packets()
+{
+    packetTimer(now());
+    return packetSizes;
+}
+
+void RNXVEmulator::remoteOpen()
+{
+    tcpConnected = true;
+    emit(opt("comm open"));
+}
+
+void RNXVEmulator::remoteClose()
+{
+    if (tcpConnected) {
+        tcpConnected = false;
+        emit(opt("comm close"));
+    }
+}
+
+void RNXVEmulator::remoteSend(const uint8_t *data, size_t size)
+{
+    emit(std::string((const char *)data, size));
+}
+
+void RNXVEmulator::remoteSend(const char *str)
+{
+    emit(str);
+}
+
+/** Canonical "category param" name from a possibly abbreviated pair */
+std::string RNXVEmulator::key(const std::string &category, const std::string &param)
+{
+    for (size_t cat=0; cat<NUM_CATEGORIES; cat++) {
+        if (isPrefix(category, optionNames[cat].category)) {
+            for (const char * const *name = optionNames[cat].params; *name; name++) {
+                if (isPrefix(param, *name)) {
+                    return std::string(optionNames[cat].category) + " " + *name;
+                }
+            }
+            return std::string(optionNames[cat].category) + " " + param;
+        }
+    }
+    return "";
+}
+
+std::string RNXVEmulator::opt(const char *name)
+{
+    Config::iterator it = config.find(name);
+    return it == config.end() ? "" : it->second;
+}
+
+uint32_t RNXVEmulator::optNum(const char *name)
+{
+    return parseNum(opt(name));
+}
+
+std::string RNXVEmulator::resolve(const std::string &name)
+{
+    std::map<std::string, std::string>::iterator it = hosts.find(name);
+    if (it != hosts.end()) {
+        return it->second;
+    }
+    if (!name.empty() && isdigit((uint8_t)name[0])) {
+        return name;
+    }
+    return "";
+}
+
+std::string RNXVEmulator::dhcpName()
+{
+    static const char *names[] = { "OFF", "ON", "AUTOIP", "CACHE", "SERVER" };
+    uint32_t mode = optNum("ip dhcp");
+    return mode < 5 ? names[mode] : "ON";
+}
+
+std::string RNXVEmulator::authName()
+{
+    static const char *names[] = { "OPEN", "WEP-128", "WPA1", "MIXED", "WPA2-PSK", "", "ADHOC", "",
+                                   "WEP-64" };
+    uint32_t mode = optNum("wlan auth");
+    return mode < 9 ? names[mode] : "";
+}
+
+std::string RNXVEmulator::protoName()
+{
+    static const char *names[] = { "UDP", "TCP", "SECURE", "TCP_CLIENT", "HTTP", "RAW", "SMTP" };
+    uint32_t proto = optNum("ip protocol");
+    std::string res;
+
+    for (int bit=0; bit<7; bit++) {
+        if (proto & (1 << bit)) {
+            res += names[bit];
+            res += ",";
+        }
+    }
+    return res;
+}
+
+/** Connection status as reported by "show c" */
+uint16_t RNXVEmulator::status()
+{
+    uint16_t res = 0x8000;
+
+    res |= tcpConnected ? 1 : 0;
+    if (associated) {
+        res |= 0x0030;    /* associated and authenticated */
+        res |= 0x0040;    /* DNS server contacted */
+        res |= (uint16_t)(channel & 0x0F) << 9;
+    }
+    return res;
+}
+
+/** Execute a command mode line */
+void RNXVEmulator::command(const std::string &cmdline)
+{
+    std::string args = cmdline;
+    std::string cmd = nextWord(args);
+
+    if (cmd.empty()) {
+        emitPrompt();
+        return;
+    }
+
+    commands++;
+
+    if (cmd == "set") {
+        if (setCommand(args)) {
+            emit("AOK\r\n");
+        } else {
+            emit("ERR: Bad Args\r\n");
+        }
+        if (mode == MODE_COMMAND) {
+            emitPrompt();
+        }
+    } else if (cmd == "get") {
+        getCommand(args);
+        emitPrompt();
+    } else if (cmd == "show") {
+        showCommand(args);
+        emitPrompt();
+    } else if (cmd == "exit") {
+        mode = MODE_DATA;
+        emit("EXIT\r\n");
+    } else if (cmd == "join") {
+        joinCommand(args);
+    } else if (cmd == "leave") {
+        associated = false;
+        tcpConnected = false;
+        channel = 0;
+        emit("DeAuth\r\n");
+        emitPrompt();
+    } else if (cmd == "open") {
+        openCommand(args);
+    } else if (cmd == "close") {
+        if (tcpConnected) {
+            tcpConnected = false;
+            emit(opt("comm close"));
+        }
+        emitPrompt();
+    } else if (cmd == "lookup") {
+        lookupCommand(args);
+    } else if (cmd == "ping") {
+        pingCommand(args);
+    } else if (cmd == "save") {
+        stored = config;
+        saves++;
+        emit("Storing in config\r\n");
+        emitPrompt();
+    } else if (cmd == "reboot") {
+        rebootCommand();
+    } else if (cmd == "factory") {
+        defaults(config);
+        emit("Set Factory Defaults\r\n");
+        emitPrompt();
+    } else if (cmd == "sleep") {
+        uint32_t wake = optNum("sys wake");
+        tcpConnected = false;
+        mode = MODE_SLEEP;
+        bootUntil = wake ? now() + (uint64_t)wake * 1000000 : (uint64_t)-1;
+        if (wake) {
+            emit("*READY*\r\n", wake * 1000000);
+        }
+    } else if (cmd == "time") {
+        emitPrompt();
+    } else if (cmd == "ver") {
+        emit("wifly-GSX Ver " + version + ", emulator\r\n");
+        emitPrompt();
+    } else {
+        emit("ERR: ?-Cmd\r\n");
+        emitPrompt();
+    }
+}
+
+/** set <category> <param> <value> */
+bool RNXVEmulator::setCommand(const std::string &cmdargs)
+{
+    std::string args = cmdargs;
+    std::string category = nextWord(args);
+    std::string param = nextWord(args);
+    std::string name = key(category, param);
+    std::string value = args;
+
+    if (name.empty() || param.empty()) {
+        return false;
+    }
+
+    if (name == "wlan ssid" || name == "wlan phrase") {
+        /* replacement character stands in for a space */
+        char replace = opt("opt replace")[0];
+        for (size_t ind=0; ind<value.size(); ind++) {
+            if (value[ind] == replace) {
+                value[ind] = ' ';
+            }
+        }
+    }
+
+    if (name == "uart instant") {
+        config["uart baud"] = value;
+        mode = MODE_DATA;
+        return true;
+    }
+
+    config[name] = value;
+    return true;
+}
+
+/** get <category> */
+void RNXVEmulator::getCommand(const std::string &cmdargs)
+{
+    std::string args = cmdargs;
+    std::string what = nextWord(args);
+
+    if (isPrefix(what, "everything")) {
+        /* each section is headed by its name, in the firmware's order */
+        static const struct {
+            const char *name;
+            const char *header;
+        } sections[] = {
+            { "adhoc", "Adhoc:" }, { "broadcast", "Broadcast:" }, { "comm", "Comm:" },
+            { "dns", "DNS:" }, { "ftp", "FTP:" }, { "ip", "IP:" }, { "mac", "Mac:" },
+            { "opt", "Optional:" }, { "sys", "Sys:" }, { "time", "Time:" },
+            { "wlan", "WLAN:" }, { "uart", "UART:" }
+        };
+        emit("wifly-GSX Ver " + version + ", emulator\r\n");
+        for (size_t ind=0; ind<sizeof(sections)/sizeof(sections[0]); ind++) {
+            emit(std::string(sections[ind].header) + "\r\n");
+            getCommand(sections[ind].name);
+        }
+        return;
+    }
+
+    if (isPrefix(what, "ip")) {
+        bool leased = associated && optNum("ip dhcp") != 0;
+        emit("IF=" + std::string(associated ? "UP" : "DOWN") + "\r\n"
+             "DHCP=" + dhcpName() + "\r\n"
+             "IP=" + (leased ? std::string("192.168.1.50") : opt("ip address")) + ":" + opt("ip localport") + "\r\n"
+             "NM=" + opt("ip netmask") + "\r\n"
+             "GW=" + (leased ? std::string("192.168.1.1") : opt("ip gateway")) + "\r\n"
+             "HOST=" + opt("ip host") + ":" + opt("ip remote") + "\r\n"
+             "PROTO=" + protoName() + "\r\n"
+             "MTU=1524\r\n"
+             + format("FLAGS=0x%x\r\n", optNum("ip flags"))
+             + "TCPMODE=0x0\r\n"
+             "BACKUP=" + opt("ip backup") + "\r\n");
+    } else if (isPrefix(what, "wlan")) {
+        emit("SSID=" + opt("wlan ssid") + "\r\n"
+             "Chan=" + opt("wlan channel") + "\r\n"
+             "ExtAnt=0\r\n"
+             "Join=" + opt("wlan join") + "\r\n"
+             "Auth=" + authName() + "\r\n"
+             "Mask=0x1fff\r\n"
+             "Rate=" + opt("wlan rate") + ", 24 Mb\r\n"
+             "Linkmon=" + opt("wlan linkmon") + "\r\n"
+             "Passphrase=" + (optNum("wlan hide") ? std::string("******") : opt("wlan phrase")) + "\r\n"
+             "TxPower=" + opt("wlan tx") + "\r\n");
+    } else if (isPrefix(what, "comm")) {
+        emit("Comm $=" + opt("comm $") + "\r\n"
+             "Close=" + opt("comm close") + "\r\n"
+             "Open=" + opt("comm open") + "\r\n"
+             "Remote=" + opt("comm remote") + "\r\n"
+             "IdleTimer=" + opt("comm idle") + "\r\n"
+             + format("MatchChar=%x\r\n", optNum("comm match"))
+             + "FlushSize=" + opt("comm size") + "\r\n"
+             "FlushTimer=" + opt("comm time") + "\r\n");
+    } else if (isPrefix(what, "uart")) {
+        emit("Baudrate=" + opt("uart baud") + "\r\n"
+             "Flow=0x" + opt("uart flow") + "\r\n"
+             + format("Mode=0x%x\r\n", optNum("uart mode"))
+             + "Cmd_GPIO=0\r\n");
+    } else if (isPrefix(what, "opt")) {
+        emit("JoinTmr=" + opt("opt jointmr") + "\r\n"
+             + format("Replace=0x%02x\r\n", (uint8_t)opt("opt replace")[0])
+             + "DeviceId=" + opt("opt deviceid") + "\r\n"
+             "Password=" + opt("opt password") + "\r\n"
+             "Format=0x" + opt("opt format") + "\r\n");
+    } else if (isPrefix(what, "mac")) {
+        emit("Mac Addr=" + mac + "\r\n");
+    } else if (isPrefix(what, "dns")) {
+        emit("Address=" + opt("dns address") + "\r\n"
+             "Name=" + opt("dns name") + "\r\n"
+             "Backup=" + opt("dns backup") + "\r\n"
+             "Lease=86400\r\n");
+    } else if (isPrefix(what, "time")) {
+        emit("ENA=" + opt("time enable") + "\r\n"
+             "ADDR=" + opt("time address") + ":" + opt("time port") + "\r\n"
+             "Zone=" + opt("time zone") + "\r\n");
+    } else if (isPrefix(what, "broadcast")) {
+        emit("IP=" + opt("broadcast address") + ":" + opt("broadcast port") + "\r\n"
+             "Interval=" + opt("broadcast interval") + "\r\n"
+             "Backup=0.0.0.0\r\n"
+             "Sensor=0x0\r\n"
+             "Vpin=0x0\r\n");
+    } else if (isPrefix(what, "ftp")) {
+        emit("FTP=" + opt("ftp addr") + ":" + opt("ftp remote") + "\r\n"
+             "File=" + opt("ftp filename") + "\r\n"
+             "User=" + opt("ftp user") + "\r\n"
+             "Pass=" + opt("ftp pass") + "\r\n"
+             "Dir=" + opt("ftp dir") + "\r\n"
+             "Timeout=" + opt("ftp time") + "\r\n"
+             "FTP_mode=" + opt("ftp mode") + "\r\n");
+    } else if (isPrefix(what, "adhoc")) {
+        emit("Beacon=" + opt("adhoc beacon") + "\r\n"
+             "Probe=" + opt("adhoc probe") + "\r\n"
+             "Reboot=" + opt("adhoc reboot") + "\r\n");
+    } else if (isPrefix(what, "sys")) {
+        emit("SleepTmr=" + opt("sys sleep") + "\r\n"
+             "WakeTmr=" + opt("sys wake") + "\r\n"
+             "IoFunc=" + opt("sys iofunc") + "\r\n"
+             "PrintLvl=" + opt("sys printlvl") + "\r\n");
+    } else {
+        emit("ERR: Bad Args\r\n");
+    }
+}
+
+/** show <what> */
+void RNXVEmulator::showCommand(const std::string &cmdargs)
+{
+    std::string args = cmdargs;
+    std::string what = nextWord(args);
+    uint32_t uptime = (now() - bootedAt) / 1000000;
+
+    if (isPrefix(what, "connection")) {
+        emit(format("%04X\r\n", status()));
+    } else if (isPrefix(what, "rssi")) {
+        emit(associated ? "RSSI=(-52) dBm\r\n" : "RSSI=(-0) dBm\r\n");
+    } else if (isPrefix(what, "time")) {
+        if (isPrefix(nextWord(args), "t")) {
+            emit(format("RTC=%u\r\n", 1360000000 + uptime));
+        } else {
+            emit(format("Time=NOT SET\r\nUpTime=%u\r\n", uptime));
+        }
+    } else {
+        emit("ERR: Bad Args\r\n");
+    }
+}
+
+/** join [ssid] */
+void RNXVEmulator::joinCommand(const std::string &cmdargs)
+{
+    std::string ssid = cmdargs.empty() ? opt("wlan ssid") : cmdargs;
+    uint8_t chan = optNum("wlan channel");
+    uint32_t dhcpMode = optNum("ip dhcp");
+    uint32_t assoc = assocMs;
+
+    if (chan == 0) {
+        /* scan all channels for the access point */
+        chan = apChannel;
+        assoc += scanMs;
+    }
+
+    if (joinFail || (chan != apChannel)) {
+        emitPrompt();
+        emit("Auto-Assoc " + ssid + " chan=0 mode=NONE FAILED\r\n", assoc * 1000);
+        associated = false;
+        return;
+    }
+
+    emit(format("Auto-Assoc %s chan=%u mode=WPA2 SCAN OK\r\n", ssid.c_str(), chan)
+         + "Joining " + ssid + " now..\r\n");
+    emitPrompt();
+    emit("Associated!\r\n", assoc * 1000);
+
+    if ((dhcpMode == 3) && lease) {
+        /* reuse the cached lease */
+        emit("IF=UP\r\n"
+             "DHCP=CACHE\r\n"
+             "IP=192.168.1.50:" + opt("ip localport") + "\r\n"
+             "NM=" + opt("ip netmask") + "\r\n"
+             "GW=192.168.1.1\r\n", assoc * 1000);
+    } else if (dhcpMode != 0) {
+        emit(format("DHCP: Start\r\nDHCP in %ums, lease=86400s\r\n", dhcpMs)
+             + "IF=UP\r\n"
+             "DHCP=" + dhcpName() + "\r\n"
+             "IP=192.168.1.50:" + opt("ip localport") + "\r\n"
+             "NM=" + opt("ip netmask") + "\r\n"
+             "GW=192.168.1.1\r\n", (assoc + dhcpMs) * 1000);
+        lease = true;
+    } else {
+        emit("IF=UP\r\n"
+             "DHCP=OFF\r\n"
+             "IP=" + opt("ip address") + ":" + opt("ip localport") + "\r\n"
+             "NM=" + opt("ip netmask") + "\r\n"
+             "GW=" + opt("ip gateway") + "\r\n", assoc * 1000);
+    }
+    emit("Listen on " + opt("ip localport") + "\r\n");
+
+    associated = true;
+    channel = chan;
+}
+
+/** open <host> <port> */
+void RNXVEmulator::openCommand(const std::string &cmdargs)
+{
+    std::string args = cmdargs;
+    std::string host = nextWord(args);
+
+    emitPrompt();
+    if (!associated || openFail || resolve(host).empty()) {
+        emit("Connect FAILED\r\n", connectMs * 1000);
+        return;
+    }
+
+    tcpConnected = true;
+    mode = MODE_DATA;
+    emit(opt("comm open"), connectMs * 1000);
+}
+
+/** lookup <hostname> */
+void RNXVEmulator::lookupCommand(const std::string &cmdargs)
+{
+    std::string args = cmdargs;
+    std::string host = nextWord(args);
+    std::string ip = associated ? resolve(host) : "";
+
+    if (ip.empty()) {
+        emit("lookup failed\r\n", lookupMs * 1000);
+    } else {
+        emit(host + "=" + ip + "\r\n", lookupMs * 1000);
+    }
+    emitPrompt();
+}
+
+/** ping <host> */
+void RNXVEmulator::pingCommand(const std::string &cmdargs)
+{
+    std::string args = cmdargs;
+    std::string ip = resolve(nextWord(args));
+
+    emit("Ping try: 1\r\n");
+    emitPrompt();
+    if (associated && !ip.empty()) {
+        emit("\r\n64 bytes reply from " + ip + ": icmp_seq=1 ttl=64 time=5 ms\r\n", 5000);
+    }
+}
+
+void RNXVEmulator::rebootCommand()
+{
+    emit("*Reboot*");
+
+    config = stored;
+    tcpConnected = false;
+    associated = false;
+    channel = 0;
+    mode = MODE_BOOT;
+    line.clear();
+    bootUntil = now() + (uint64_t)bootMs * 1000;
+    bootedAt = bootUntil;
+
+    emit("wifly-GSX Ver " + version + ", emulator\r\n"
+         "MAC Addr=00:06:66:71:b4:17\r\n"
+         "*READY*\r\n", bootMs * 1000);
+
+    if (optNum("wlan join") == 1 && !joinFail) {
+        uint8_t chan = optNum("wlan channel");
+        associated = true;
+        channel = chan ? chan : apChannel;
+    }
+}
@@ -0,0 +1,208 @@
+/*-
+ * Copyright (c) 2012,2013 Darran Hunt (darran [at] hunt dot net dot nz)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file RNXVEmulator.h
+ *
+ * @brief A scriptable stand-in for a WiFly RN-XV module.
+ *
+ * The emulator is a Stream that the WiFly class can be started on in place
+ * of the module's serial port. It models the 2.32 command interpreter
+ * ($$$ entry, set/get/show, join, open/close, lookup, ping, save, reboot)
+ * and data mode with TCP open and close markers. Responses can be delayed
+ * by a fixed latency and paced at a configured baud rate so that timing
+ * behaviour can be reproduced without hardware.
+ *
+ * The remote side of a TCP connection or UDP session is driven with
+ * remoteSend(), remoteOpen() and remoteClose(); data written by the
+ * WiFly in data mode is collected and returned by sent().
+ *
+ * Give the emulator and the WiFly the same SimClock, and attach the
+ * emulator to it, to run sessions in simulated time.
+ */
+
+#ifndef _RNXVEMULATOR_H_
+#define _RNXVEMULATOR_H_
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+
+#include "SimClock.h"
+
+class RNXVEmulator : public Stream, public SimTimed {
+public:
+    RNXVEmulator();
+
+    /* Time source, defaults to micros() */
+    void setClock(WFClock *clock);
+    virtual uint32_t usecsToNextEvent();
+
+    /* Serial side, used by the WiFly */
+    virtual int available();
+    virtual int read();
+    virtual int peek();
+    virtual void flush();
+    virtual size_t write(uint8_t byte);
+    virtual size_t write(const uint8_t *buf, size_t size);
+    using Print::write;
+
+    /* Timing */
+    void setBaud(uint32_t baud);            /* 0 = deliver bytes instantly */
+    void setLatency(uint32_t usecs);        /* delay before each response */
+    void setGuardTime(uint16_t msecs);      /* idle time needed before $$$ */
+    void setJoinTime(uint32_t assocMsecs, uint32_t dhcpMsecs);
+    void setScanTime(uint32_t msecs);       /* extra join time when no channel is set */
+    void setConnectTime(uint32_t msecs);
+    void setLookupTime(uint32_t msecs);     /* DNS lookup round trip */
+    void setBootTime(uint32_t msecs);
+
+    /* Module configuration and behaviour */
+    void setOption(const char *key, const char *value);
+    const char *getOption(const char *key);
+    void setVersion(const char *version);
+    void setMAC(const char *mac);
+    void setAssociated(bool assoc, uint8_t channel=6);
+    void setJoinFail(bool fail);
+    void setAPChannel(uint8_t channel);     /* channel the access point is on */
+    void setOpenFail(bool fail);
+    void addHost(const char *name, const char *ip);
+
+    /* Remote peer */
+    void remoteOpen();
+    void remoteClose();
+    void remoteSend(const uint8_t *data, size_t size);
+    void remoteSend(const char *str);
+    const std::string &sent() const { return dataOut; }
+    void clearSent() { dataOut.clear(); }
+    const std::vector<uint32_t> &packets(); /* sizes of the packets sent */
+    void clearPackets() { packetSizes.clear(); }
+
+    /* State and counters */
+    bool inCommandMode() const { return mode == MODE_COMMAND; }
+    bool isConnected() const { return tcpConnected; }
+    bool isAssociated() const { return associated; }
+    uint32_t commandCount() const { return commands; }
+    uint32_t commandModeEntries() const { return cmdEntries; }
+    uint32_t saveCount() const { return saves; }
+    uint32_t bytesToHost() const { return txBytes; }
+    uint32_t bytesFromHost() const { return rxBytes; }
+    uint32_t writeCalls() const { return writes; }    /* write() calls from the host */
+
+private:
+    enum Mode { MODE_DATA, MODE_COMMAND, MODE_SLEEP, MODE_BOOT };
+
+    typedef std::map<std::string, std::string> Config;
+
+    /* A block of output; byte n is on the wire at start + (n+1)*byteUs */
+    struct Chunk {
+        uint64_t start;
+        uint32_t byteUs;
+        std::string data;
+        size_t pos;
+    };
+
+    uint64_t now();
+    void emit(const std::string &str, uint32_t delayUs=0);
+    void emitPrompt();
+    void input(uint8_t ch);
+    void command(const std::string &line);
+    void dataByte(uint8_t ch, uint64_t t);
+    void packetTimer(uint64_t t);
+
+    bool setCommand(const std::string &args);
+    void getCommand(const std::string &args);
+    void showCommand(const std::string &args);
+    void joinCommand(const std::string &args);
+    void openCommand(const std::string &args);
+    void lookupCommand(const std::string &args);
+    void pingCommand(const std::string &args);
+    void rebootCommand();
+
+    std::string key(const std::string &category, const std::string &param);
+    std::string opt(const char *key);
+    uint32_t optNum(const char *key);
+    std::string resolve(const std::string &name);
+    std::string dhcpName();
+    std::string authName();
+    std::string protoName();
+    uint16_t status();
+    void defaults(Config &cfg);
+
+    WFClock *clock;
+    uint32_t lastMicros;
+    uint64_t microsHigh;
+
+    std::deque<Chunk> out;
+    uint64_t outEnd;
+    uint32_t byteUs;
+    uint32_t latencyUs;
+    uint32_t guardMs;
+    uint32_t assocMs;
+    uint32_t dhcpMs;
+    uint32_t scanMs;
+    uint32_t connectMs;
+    uint32_t lookupMs;
+    uint32_t bootMs;
+
+    Mode mode;
+    std::string line;
+    uint8_t dollars;
+    uint64_t lastRx;
+    uint64_t bootUntil;
+    uint64_t bootedAt;
+
+    Config config;      /* running configuration */
+    Config stored;      /* configuration saved in flash */
+    std::map<std::string, std::string> hosts;
+    std::string version;
+    std::string mac;
+
+    bool associated;
+    uint8_t channel;
+    uint8_t apChannel;
+    bool lease;         /* holds a DHCP lease for DHCP cache mode */
+    bool tcpConnected;
+    bool joinFail;
+    bool openFail;
+
+    std::string dataOut;
+    std::vector<uint32_t> packetSizes;
+    uint32_t packetLen;     /* bytes collected for the next packet */
+    uint64_t packetLast;    /* when the last of them arrived */
+
+    uint32_t commands;
+    uint32_t cmdEntries;
+    uint32_t saves;
+    uint32_t txBytes;
+    uint32_t writes;
+    uint32_t rxBytes;
+};
+
+#endif
@@ -0,0 +1,72 @@
+/*-
+ * Copyright (c) 2012,2013 Darran Hunt (darran [at] hunt dot net dot nz)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL
+ * THE CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file SimClock.h
+ *
+ * @brief Simulated time source for running the WiFly against emulated
+ *        modules without waiting in wall-clock time.
+ *
+ * delay() advances the clock immediately. idle(), which the WiFly calls
+ * while it waits for serial data, advances the clock to the next event
+ * scheduled by any attached SimTimed source (at most one millisecond at
+ * a time, so timeouts still expire).
+ */
+
+#ifndef _SIMCLOCK_H_
+#define _SIMCLOCK_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include <WiFlyHQ.h>
+
+/** Something that schedules events on a SimClock */
+class SimTimed {
+public:
+    virtual ~SimTimed() {}
+    /** Microseconds until the next scheduled event, 0 if one is due now */
+    virtual uint32_t usecsToNextEvent() = 0;
+};
+
+class SimClock : public WFClock {
+public:
+    SimClock() : now(0) {}
+
+    virtual uint32_t millis() { return (uint32_t)(now / 1000); }
+    virtual uint32_t micros() { return (uint32_t)now; }
+    virtual void delay(uint32_t msecs) { now += (uint64_t)msecs * 1000; }
+    virtual void idle();
+
+    void attach(SimTimed *source) { sources.push_back(source); }
+    void advance(uint64_t usecs) { now += usecs; }
+    uint64_t usecs() const { return now; }
+
+private:
+    uint64_t now;
+    std::vector<SimTimed *> sources;
+};
+
+#endif